@@ -0,0 +1,922 @@
+// 性能测试，运行 make bench
+// 输出为制表符分隔的表格，#开头的行是注释，方便保存下来和其它版本比较：
+//     ./bench/bench [过滤字符串] > result.tsv
+// 并发压力测试不是默认运行的，见BenchStress：
+//     ./bench/bench stress                    在临时目录中直接调用FileControl
+//     ./bench/bench stress_mount 挂载点/密钥名  通过挂载好的共享
+#include "aes.h"
+#include "aes_parallel.h"
+#include "aes_gcm.h"
+#include "common.h"
+#include "block_store.h"
+#include "networking.h"
+#include "file_control.h"
+#include "options.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// 统计堆分配次数
+static atomic<uint64_t> alloc_count(0);
+
+// noinline: 否则GCC把new和delete内联到一起后，会把malloc/free误报为-Wmismatched-new-delete
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    alloc_count ++;
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) throw bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+static string filter;
+
+// bench中的FileControl不监听网络，广播的包直接丢掉
+static void DropPackets(const data_t&)
+{
+}
+
+static double Seconds(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// 重复执行func直到总时间超过0.5秒，输出一行结果
+// bytes为每次处理的数据量，为0时不输出MB/s和allocs/MB
+template<class F>
+static void Run(const string& name, size_t bytes, F func)
+{
+    if (name.find(filter) == string::npos) return;
+
+    func(); // warm up
+    size_t rounds = 0, batch = 1;
+    uint64_t allocs = alloc_count;
+    auto start = chrono::steady_clock::now();
+    double elapsed;
+    while (true) {
+        for(size_t i = 0; i < batch; i ++) func();
+        rounds += batch;
+        elapsed = Seconds(start);
+        if (elapsed >= 0.5) break;
+        if (elapsed < 0.05) batch *= 2;
+    }
+    allocs = alloc_count - allocs;
+
+    double ns = elapsed * 1e9 / rounds;
+    double mbs = bytes * rounds / elapsed / 1e6;
+    double per_op = (double)allocs / rounds;
+    printf("%s\t%zu\t%.1f\t%.1f\t%.2f\t%.1f\n", name.c_str(), bytes, bytes ? mbs : 0.0, ns, per_op, bytes ? per_op * 1e6 / bytes : 0.0);
+    fflush(stdout);
+}
+
+static AesKey BenchKey()
+{
+    uint8_t raw_key[32] = {1, 2, 3};
+    AesKey key;
+    aes_expand_key(raw_key, sizeof(raw_key), &key);
+    return key;
+}
+
+static void BenchAes()
+{
+    const size_t max_size = 256 << 20;
+    vector<uint8_t> in(max_size), out(max_size);
+    for(size_t i = 0; i < max_size; i ++) in[i] = (uint8_t)(i * 131);
+
+    // 逐字节实现太慢，只测到64KiB
+    struct { const char* name; size_t max_size; } backends[] = {
+        {"aes-ni", max_size}, {"bitsliced", max_size}, {"table", max_size}, {"bytewise", 64 << 10},
+    };
+    for(const auto& backend : backends) {
+        if (!aes_select_backend(backend.name)) continue;
+        AesKey key = BenchKey();
+        string suffix = string("/") + backend.name;
+        for(size_t size = 16; size <= backend.max_size; size *= 16) {
+            Run("aes_encode" + suffix, size, [&]() { aes_encode(key, in.data(), size, out.data()); });
+            Run("aes_decode" + suffix, size, [&]() { aes_decode(key, out.data(), size, in.data()); });
+        }
+    }
+    aes_select_backend("auto");
+}
+
+static void BenchParallel(size_t size)
+{
+    vector<uint8_t> in(size), out(size);
+    for(size_t i = 0; i < size; i ++) in[i] = (uint8_t)(i * 131);
+    AesKey key = BenchKey();
+
+    vector<int> workers = {1, 2, 4, (int)thread::hardware_concurrency()};
+    for(int w : workers) {
+        aes_set_parallel_workers(w);
+        string suffix = "/" + to_string(w);
+        Run("aes_encode_parallel" + suffix, size, [&]() { aes_encode_parallel(key, in.data(), size, out.data()); });
+        Run("aes_decode_parallel" + suffix, size, [&]() { aes_decode_parallel(key, out.data(), size, in.data()); });
+        Run("aes_ctr_xor_parallel" + suffix, size, [&]() { aes_ctr_xor_parallel(key, in.data(), 0, in.data(), size, out.data()); });
+    }
+    aes_set_parallel_workers(0);
+}
+
+static void BenchPacket()
+{
+    // 最大的包是BroadcastFile发出的PacketHead+ModifyPacket+CHUNK_MAX_SIZE
+    vector<size_t> sizes = {64, 1024, sizeof(PacketHead) + sizeof(ModifyPacket) + CHUNK_MAX_SIZE};
+    vector<AesKey> keys(1, BenchKey());
+
+    for(int version = 1; version <= 2; version ++) {
+        Networking net(keys, version);
+        string suffix = "/v" + to_string(version);
+        for(size_t size : sizes) {
+            data_t payload = CreateBuffer(size);
+            memset(payload->data(), 0, size);
+            data_t packet = net.Encode(0, payload);
+            data_t decoded;
+            Run("packet_encode" + suffix, size, [&]() { net.Encode(0, payload); });
+            Run("packet_decode" + suffix, size, [&]() {
+                if (!net.Decode(packet->data(), packet->size(), decoded)) abort();
+            });
+        }
+    }
+
+    // 配置了很多组密钥时，收到其它组的数据包需要多久才能丢弃
+    vector<AesKey> many;
+    for(int i = 0; i < 32; i ++) {
+        uint8_t raw_key[32] = {(uint8_t)i, 0xaa};
+        many.push_back(AesKey());
+        aes_expand_key(raw_key, sizeof(raw_key), &many.back());
+    }
+    Networking receiver(many, 2);
+    for(int version = 1; version <= 2; version ++) {
+        Networking foreign(keys, version);
+        data_t payload = CreateData();
+        payload->resize(1024, 0);
+        data_t packet = foreign.Encode(0, payload);
+        data_t decoded;
+        Run("packet_reject_32keys/v" + to_string(version), 1024, [&]() {
+            if (receiver.Decode(packet->data(), packet->size(), decoded)) abort();
+        });
+    }
+}
+
+static void BenchFile()
+{
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    FileControl control(dir, vector<string>(1, "bench:benchkey"));
+    control.SetSender(DropPackets);
+    mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+    mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+
+    const char* path = "/bench/file";
+    control.AddFile(path);
+    string filepath = control.Resolve(path);
+
+    for(size_t size = 4096; size <= (64 << 20); size *= 16) {
+        data_t data = CreateData();
+        data->resize(size);
+        for(size_t i = 0; i < size; i ++) (*data)[i] = (uint8_t)(i * 7);
+
+        Run("file_save", size, [&]() {
+            int fd = open(filepath.c_str(), O_WRONLY|O_CREAT, 0666);
+            control.SaveFile(path, data);
+            close(fd);
+        });
+        Run("file_load", size, [&]() { control.LoadFile(path); });
+
+        // 随机读4KiB，每次只需要载入所在的块
+        int fd = open(filepath.c_str(), O_RDONLY);
+        char buf[4096];
+        size_t offset = 0;
+        Run("file_read_4k/" + to_string(size), sizeof(buf), [&]() {
+            offset = (offset + 7 * sizeof(buf) + 123) % size;
+            control.ReadFile(path, fd, buf, sizeof(buf), offset);
+        });
+        close(fd);
+
+        // 在文件末尾追加一行再写回，只有最后一块需要重新加密和写入
+        char line[100];
+        memset(line, 'x', sizeof(line));
+        size_t end = size;
+        uint64_t appends = 0;
+        CacheStats before = control.Stats();
+        Run("file_append_flush/" + to_string(size), sizeof(line), [&]() {
+            control.WriteFile(path, -1, line, sizeof(line), end);
+            control.FlushFile(path);
+            end += sizeof(line);
+            appends ++;
+        });
+        if (appends > 0) {
+            printf("# file_append_flush/%zu: %.0f flush bytes/op\n", size, (double)(control.Stats().flush_bytes - before.flush_bytes) / appends);
+        }
+        control.ClearCache(path);
+    }
+
+    // 读已经缓存的块，路径较长(不能放在string内部)时比较按路径查找和low-level前端传入记录和FileHandle
+    const char* long_path = "/bench/a-file-name-longer-than-short-strings.dat";
+    File* x = control.AddFile(long_path);
+    vector<char> block(BLOCK_SIZE, 'x');
+    control.WriteFile(long_path, -1, block.data(), block.size(), 0);
+    FileHandle handle;
+    handle.file = NULL;
+    string real = control.Resolve(long_path);
+    FileRef ref = {real.c_str(), PathHash()(long_path), x, &handle};
+    char buf[4096];
+    Run("file_read_cached/path", sizeof(buf), [&]() { control.ReadFile(long_path, -1, buf, sizeof(buf), 0); });
+    Run("file_read_cached/handle", sizeof(buf), [&]() { control.ReadFile(long_path, -1, buf, sizeof(buf), 0, &ref); });
+    control.Sync(long_path);
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+// 一个经常读的小文件和一个顺序扫描的大文件同时使用缓存，扫描不应该把小文件挤出去
+static void BenchCache()
+{
+    if (string("cache_scan").find(filter) == string::npos) return;
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    int cache_size = options.cache_size;
+    options.cache_size = 16;
+    FileControl control(dir, vector<string>(1, "bench:benchkey"));
+    control.SetSender(DropPackets);
+    options.cache_size = cache_size;
+    mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+    mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+
+    const char* hot = "/bench/hot";
+    const char* cold = "/bench/cold";
+    const size_t hot_size = 8 << 20, cold_size = 256 << 20;
+    vector<char> buf(BLOCK_SIZE, 'x');
+    for(const char* path : {hot, cold}) {
+        control.AddFile(path);
+        size_t size = path == hot ? hot_size : cold_size;
+        for(size_t pos = 0; pos < size; pos += buf.size()) {
+            control.WriteFile(path, -1, buf.data(), buf.size(), pos);
+        }
+        control.FlushFile(path);
+        control.ClearCache(path);
+    }
+    // 让小文件的块被访问两次
+    for(int i = 0; i < 2; i ++) {
+        for(size_t pos = 0; pos < hot_size; pos += buf.size()) {
+            control.ReadFile(hot, -1, buf.data(), buf.size(), pos);
+        }
+    }
+
+    size_t hot_pos = 0, cold_pos = 0;
+    uint64_t hot_reads = 0, hot_hits = 0;
+    Run("cache_scan", 5 * buf.size(), [&]() {
+        for(int i = 0; i < 4; i ++) {
+            control.ReadFile(cold, -1, buf.data(), buf.size(), cold_pos);
+            cold_pos = (cold_pos + buf.size()) % cold_size;
+        }
+        uint64_t hits = control.Stats().hits;
+        control.ReadFile(hot, -1, buf.data(), buf.size(), hot_pos);
+        hot_pos = (hot_pos + 7 * buf.size()) % hot_size;
+        hot_hits += control.Stats().hits - hits;
+        hot_reads ++;
+    });
+    CacheStats stats = control.Stats();
+    printf("# cache_scan: hot hit ratio %.3f, %lu evictions, %lu of %lu bytes cached\n",
+        (double)hot_hits / hot_reads, (unsigned long)stats.evictions, (unsigned long)stats.cached_bytes, (unsigned long)stats.budget_bytes);
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+// 冷缓存下顺序读一个大文件，每次读128KiB(FUSE一次读请求的大小)，比较有无预读
+static void BenchReadahead()
+{
+    if (filter.compare(0, 12, "file_stream/") != 0 && string("file_stream").find(filter) == string::npos) return;
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    int readahead = options.readahead;
+    const char* path = "/bench/stream";
+    const size_t size = 64 << 20;
+    vector<char> buf(128 << 10, 'x');
+    for(int window : {0, readahead}) {
+        options.readahead = window;
+        FileControl control(dir, vector<string>(1, "bench:benchkey"));
+        control.SetSender(DropPackets);
+        mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+        mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+        if (control.FindFile(path) == NULL) {
+            control.AddFile(path);
+            for(size_t pos = 0; pos < size; pos += buf.size()) {
+                control.WriteFile(path, -1, buf.data(), buf.size(), pos);
+            }
+            control.FlushFile(path);
+        }
+        control.ClearCache(path);
+
+        size_t pos = 0;
+        Run("file_stream/" + to_string(window), buf.size(), [&]() {
+            control.ReadFile(path, 3, buf.data(), buf.size(), pos);
+            pos += buf.size();
+            if (pos == size) {
+                pos = 0;
+                control.ClearCache(path);
+            }
+        });
+        CacheStats stats = control.Stats();
+        printf("# file_stream/%d: %lu readahead bytes, %lu readahead hits, %lu wasted bytes\n", window,
+            (unsigned long)stats.readahead_bytes, (unsigned long)stats.readahead_hits, (unsigned long)stats.readahead_wasted);
+    }
+    options.readahead = readahead;
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+// 后台同步一批修改过的小文件：每个文件单独fsync，或者全部写回之后一次syncfs
+static void BenchWriteback()
+{
+    if (string("writeback_strict writeback_batched").find(filter) == string::npos && filter.compare(0, 10, "writeback_") != 0) return;
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    FileControl control(dir, vector<string>(1, "bench:benchkey"));
+    control.SetSender(DropPackets);
+    mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+    mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+
+    const int count = 64;
+    vector<string> paths;
+    for(int i = 0; i < count; i ++) {
+        paths.push_back("/bench/file" + to_string(i));
+        control.AddFile(paths.back().c_str());
+    }
+    char buf[4096];
+    memset(buf, 'x', sizeof(buf));
+
+    for(bool durable : {true, false}) {
+        Run(string(durable ? "writeback_strict/" : "writeback_batched/") + to_string(count), count * sizeof(buf), [&]() {
+            for(const auto& path : paths) {
+                control.WriteFile(path.c_str(), -1, buf, sizeof(buf), 0);
+            }
+            for(const auto& path : paths) {
+                control.FlushFile(path.c_str(), durable);
+            }
+            if (!durable) control.SyncAll();
+        });
+    }
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+// BlockFile直接读写磁盘：读要读数据和块表，写要写数据和块表，同步要fsync两个文件
+static void BenchBlockFile()
+{
+    if (filter.compare(0, 10, "blockfile_") != 0 && string("blockfile_read_64k blockfile_write_64k blockfile_sync").find(filter) == string::npos) return;
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    AesKey key = BenchKey();
+    BlockFile file(key);
+    if (file.Open(string(dir) + "/data", string(dir) + "/map", true) == -1) {
+        perror("open");
+        return;
+    }
+    const size_t size = 16 << 20;
+    vector<uint8_t> buf(BLOCK_SIZE, 'x');
+    for(size_t pos = 0; pos < size; pos += buf.size()) file.Write(buf.data(), buf.size(), pos);
+
+    size_t offset = 0;
+    Run("blockfile_read_64k", buf.size(), [&]() {
+        offset = (offset + 7 * buf.size()) % size;
+        file.Read(buf.data(), buf.size(), offset);
+    });
+    Run("blockfile_write_64k", buf.size(), [&]() {
+        offset = (offset + 7 * buf.size()) % size;
+        file.Write(buf.data(), buf.size(), offset);
+    });
+    Run("blockfile_sync", 4096, [&]() {
+        offset = (offset + 7 * buf.size()) % size;
+        file.Write(buf.data(), 4096, offset);
+        file.Sync();
+    });
+    file.Close();
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+// 元数据操作的延迟和文件数的关系，FindFile在getattr、读写和收到的每个包中都会调用
+static void BenchMeta()
+{
+    // 建立10万条记录比较慢，过滤掉时不做
+    if (string("meta_find_miss meta_syncdir_empty").find(filter) == string::npos && filter.compare(0, 5, "meta_") != 0) return;
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    FileControl control(dir, vector<string>(1, "bench:benchkey"));
+    control.SetSender(DropPackets);
+    mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+    mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+    for(int d = 0; d < 100; d ++) {
+        mkdir(control.Resolve("bench/dir" + to_string(d)).c_str(), S_IRWXU);
+    }
+
+    size_t count = 0, cached = 0;
+    for(size_t files = 1000; files <= 100000; files *= 10) {
+        for(; count < files; count ++) {
+            control.AddFile(("/bench/dir" + to_string(count % 100) + "/file" + to_string(count)).c_str());
+        }
+        string suffix = "/" + to_string(files);
+        size_t i = 0;
+        Run("meta_find" + suffix, 0, [&]() {
+            i = (i + 7919) % files;
+            char path[64]; // 不在这里分配，allocs/op只算FindFile自己的
+            snprintf(path, sizeof(path), "/bench/dir%d/file%d", (int)(i % 100), (int)i);
+            if (control.FindFile(path) == NULL) abort();
+        });
+        Run("meta_find_miss" + suffix, 0, [&]() {
+            if (control.FindFile("/bench/dir0/missing") != NULL) abort();
+        });
+
+        // readdir和rmdir都会SyncDir，只应该和这个目录下的缓存项有关，和整个共享中缓存的文件数无关
+        if (files > 10000) continue;
+        for(; cached < files; cached ++) {
+            string path = "/bench/dir" + to_string(cached % 100) + "/file" + to_string(cached);
+            control.WriteFile(path.c_str(), -1, "x", 1, 0);
+            control.FlushFile(path.c_str());
+        }
+        Run("meta_syncdir_empty" + suffix, 0, [&]() { control.SyncDir("/bench/empty/"); });
+    }
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+static void BenchData()
+{
+    for(size_t size = 64; size <= (1 << 20); size *= 128) {
+        vector<uint8_t> raw(size);
+        data_t a = CreateData(raw.data(), size);
+        data_t b = CreateData(raw.data(), size);
+        Run("CreateData", size, [&]() { CreateData(raw.data(), size); });
+        Run("CreateBuffer", size, [&]() { CreateBuffer(size); });
+        // 截短之后放回缓冲池，比如淘汰前被截短的最后一块
+        Run("CreateBuffer_shrunk", size, [&]() { CreateBuffer(size)->resize(size / 128); });
+        Run("Clone", size, [&]() { Clone(a); });
+        Run("Concat", size * 2, [&]() { Concat(a, b); });
+    }
+}
+
+// 并发压力测试：多个线程同时读写、截断、改名、删除，检查每个线程自己的文件内容始终正确
+// 每个线程有一个只有它自己访问的文件，在内存中保存期望的内容，每次读和stat都对照；
+// 另外所有线程争用几个共享的文件，只要求不崩溃、不死锁
+class StressFs
+{
+public:
+    virtual ~StressFs() {}
+    virtual string Root() = 0; // 测试用的目录，下面的路径都在这里面
+    virtual int Create(const string& path) = 0; // 出错时返回-1
+    virtual ssize_t Write(const string& path, const uint8_t* buf, size_t size, uint64_t offset) = 0;
+    virtual ssize_t Read(const string& path, uint8_t* buf, size_t size, uint64_t offset) = 0;
+    virtual int Truncate(const string& path, uint64_t size) = 0;
+    virtual int Size(const string& path, uint64_t& size) = 0;
+    virtual int Rename(const string& from, const string& to) = 0;
+    virtual int Unlink(const string& path) = 0;
+    virtual void Sync(const string& path) = 0;
+};
+
+// 直接调用FileControl，按FUSE前端的方式调用；内核对同一个目录的新建、删除和改名加锁，这里用ns模拟
+class ControlFs : public StressFs
+{
+public:
+    ControlFs(FileControl& control) : control(control) {}
+    string Root() { return "/bench/stress"; }
+    int Create(const string& path)
+    {
+        lock_guard<shared_timed_mutex> guard(ns);
+        struct stat st;
+        if (control.Stat(path.c_str(), &st) == 0) return 0;
+        int fd = control.NewFile(path.c_str(), O_CREAT|O_WRONLY, 0666);
+        if (fd == -1) return -1;
+        close(fd);
+        return 0;
+    }
+    ssize_t Write(const string& path, const uint8_t* buf, size_t size, uint64_t offset)
+    {
+        shared_lock<shared_timed_mutex> guard(ns);
+        if (!Exists(path)) return -1;
+        string real = control.Resolve(path);
+        FileRef ref = Ref(path, real);
+        return control.WriteFile(path.c_str(), -1, (const char*)buf, size, offset, &ref);
+    }
+    ssize_t Read(const string& path, uint8_t* buf, size_t size, uint64_t offset)
+    {
+        shared_lock<shared_timed_mutex> guard(ns);
+        if (!Exists(path)) return -1;
+        string real = control.Resolve(path);
+        FileRef ref = Ref(path, real);
+        return control.ReadFile(path.c_str(), -1, (char*)buf, size, offset, &ref);
+    }
+    int Truncate(const string& path, uint64_t size)
+    {
+        shared_lock<shared_timed_mutex> guard(ns);
+        if (!Exists(path)) return -1;
+        return control.TruncateFile(path.c_str(), size);
+    }
+    int Size(const string& path, uint64_t& size)
+    {
+        shared_lock<shared_timed_mutex> guard(ns);
+        struct stat st;
+        if (control.Stat(path.c_str(), &st) == -1) return -1;
+        size = st.st_size;
+        return 0;
+    }
+    int Rename(const string& from, const string& to)
+    {
+        lock_guard<shared_timed_mutex> guard(ns);
+        if (!Exists(from)) return -1;
+        if (control.RenameFile(from.c_str(), to.c_str()) < 0) return -1;
+        // 和low-level前端一样，打开的文件跟着移到新的路径，原来保存的缓存项不能再用
+        lock_guard<mutex> handles_guard(handles_mutex);
+        swap(handles[from], handles[to]);
+        return 0;
+    }
+    int Unlink(const string& path)
+    {
+        lock_guard<shared_timed_mutex> guard(ns);
+        if (!Exists(path)) return -1;
+        control.Sync(path.c_str());
+        control.ClearCache(path.c_str());
+        return control.DeleteFile(path.c_str());
+    }
+    void Sync(const string& path)
+    {
+        shared_lock<shared_timed_mutex> guard(ns);
+        if (Exists(path)) control.Sync(path.c_str());
+    }
+
+private:
+    bool Exists(const string& path)
+    {
+        struct stat st;
+        return control.FindFile(path.c_str()) != NULL && control.Stat(path.c_str(), &st) == 0;
+    }
+    // 每个路径一个一直打开着的文件，读写时像low-level前端一样传入记录和缓存项，real要在使用期间一直有效
+    FileRef Ref(const string& path, const string& real)
+    {
+        lock_guard<mutex> guard(handles_mutex);
+        unique_ptr<FileHandle>& handle = handles[path];
+        if (handle == nullptr) {
+            handle.reset(new FileHandle);
+            handle->file = NULL;
+        }
+        FileRef ref = {real.c_str(), PathHash()(path.c_str()), control.FindFile(path.c_str()), handle.get()};
+        return ref;
+    }
+
+private:
+    FileControl& control;
+    shared_timed_mutex ns;
+    mutex handles_mutex;
+    map<string, unique_ptr<FileHandle>> handles; // 只增加不删除，返回的指针一直有效
+};
+
+// 通过系统调用访问挂载好的共享，root为挂载点下某个密钥对应的文件夹中的一个目录
+class MountFs : public StressFs
+{
+public:
+    MountFs(const string& root) : root(root) {}
+    string Root() { return root; }
+    int Create(const string& path)
+    {
+        int fd = open(path.c_str(), O_CREAT|O_WRONLY, 0666);
+        return fd == -1 ? -1 : close(fd);
+    }
+    ssize_t Write(const string& path, const uint8_t* buf, size_t size, uint64_t offset)
+    {
+        int fd = open(path.c_str(), O_WRONLY);
+        if (fd == -1) return -1;
+        ssize_t res = pwrite(fd, buf, size, offset);
+        close(fd);
+        return res;
+    }
+    ssize_t Read(const string& path, uint8_t* buf, size_t size, uint64_t offset)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return -1;
+        ssize_t res = pread(fd, buf, size, offset);
+        close(fd);
+        return res;
+    }
+    int Truncate(const string& path, uint64_t size) { return truncate(path.c_str(), size); }
+    int Size(const string& path, uint64_t& size)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1) return -1;
+        size = st.st_size;
+        return 0;
+    }
+    int Rename(const string& from, const string& to) { return rename(from.c_str(), to.c_str()); }
+    int Unlink(const string& path) { return unlink(path.c_str()); }
+    void Sync(const string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) return;
+        fsync(fd);
+        close(fd);
+    }
+
+private:
+    string root;
+};
+
+#define STRESS_SHARED_FILES 4
+#define STRESS_MAX_SIZE (3*BLOCK_SIZE)
+
+// 一个线程的操作，自己的文件出错或者内容不对时errors加1
+static void StressWorker(StressFs& fs, int id, double seconds, atomic<uint64_t>& ops, atomic<uint64_t>& errors)
+{
+    uint32_t seed = 2654435761u * (id + 1);
+    auto next = [&](uint32_t n) { seed = seed * 1103515245 + 12345; return (seed >> 8) % n; };
+    string own = fs.Root() + "/t" + to_string(id);
+    string moved = own + ".moved";
+    vector<uint8_t> expect, buf(STRESS_MAX_SIZE);
+    auto fail = [&](const char* what) {
+        fprintf(stderr, "stress thread %d: %s\n", id, what);
+        errors ++;
+    };
+
+    if (fs.Create(own) == -1) fail("create");
+    auto start = chrono::steady_clock::now();
+    while (Seconds(start) < seconds) {
+        uint32_t op = next(100);
+        if (op < 30) { // 写自己的文件
+            uint64_t offset = next(STRESS_MAX_SIZE);
+            size_t size = 1 + next(STRESS_MAX_SIZE - offset);
+            for(size_t i = 0; i < size; i ++) buf[i] = (uint8_t)next(256);
+            if (fs.Write(own, buf.data(), size, offset) != (ssize_t)size) fail("write");
+            if (expect.size() < offset + size) expect.resize(offset + size, 0);
+            memcpy(expect.data() + offset, buf.data(), size);
+        } else if (op < 55) { // 读自己的文件并对照
+            uint64_t offset = next(STRESS_MAX_SIZE);
+            size_t size = 1 + next(STRESS_MAX_SIZE - offset);
+            ssize_t res = fs.Read(own, buf.data(), size, offset);
+            size_t want = offset >= expect.size() ? 0 : min(size, expect.size() - offset);
+            if (res != (ssize_t)want || memcmp(buf.data(), expect.data() + offset, want) != 0) fail("read mismatch");
+        } else if (op < 65) {
+            uint64_t size;
+            if (fs.Size(own, size) == -1 || size != expect.size()) fail("size mismatch");
+        } else if (op < 70) {
+            uint64_t size = next(STRESS_MAX_SIZE);
+            if (fs.Truncate(own, size) == -1) fail("truncate");
+            expect.resize(size, 0);
+        } else if (op < 72) { // 改名再改回来，内容不变
+            if (fs.Rename(own, moved) == -1 || fs.Rename(moved, own) == -1) fail("rename");
+        } else if (op < 74) {
+            fs.Sync(own);
+        } else { // 共享的文件，结果不检查
+            string shared = fs.Root() + "/shared" + to_string(next(STRESS_SHARED_FILES));
+            string other = fs.Root() + "/shared" + to_string(next(STRESS_SHARED_FILES));
+            uint64_t offset = next(STRESS_MAX_SIZE), size64;
+            size_t size = 1 + next(STRESS_MAX_SIZE - offset);
+            switch (next(8)) {
+            case 0: fs.Create(shared); break;
+            case 1: fs.Unlink(shared); break;
+            case 2: if (shared != other) fs.Rename(shared, other); break;
+            case 3: fs.Truncate(shared, offset); break;
+            case 4: fs.Size(shared, size64); break;
+            case 5: fs.Sync(shared); break;
+            case 6: fs.Read(shared, buf.data(), size, offset); break;
+            default: fs.Write(shared, buf.data(), size, offset); break;
+            }
+        }
+        ops ++;
+    }
+
+    fs.Sync(own);
+    uint64_t size;
+    if (fs.Size(own, size) == -1 || size != expect.size()) fail("final size mismatch");
+    if (fs.Read(own, buf.data(), expect.size(), 0) != (ssize_t)expect.size() || memcmp(buf.data(), expect.data(), expect.size()) != 0) fail("final read mismatch");
+    if (fs.Unlink(own) == -1) fail("unlink");
+}
+
+#define STRESS_REMOTE_FILES 4
+
+// 模拟其它节点：把修改、删除和上线的包交给接收线程的处理函数
+// remoteN只由这里修改，每次修改或删除之后读出来对照；同时也修改和删除工作线程正在读写的sharedN，结果不检查
+static void StressRemote(FileControl& control, const string& root, double seconds, atomic<uint64_t>& ops, atomic<uint64_t>& errors)
+{
+    uint32_t seed = 0x9e3779b9u;
+    auto next = [&](uint32_t n) { seed = seed * 1103515245 + 12345; return (seed >> 8) % n; };
+    vector<vector<uint8_t>> expect(STRESS_REMOTE_FILES);
+    vector<uint8_t> buf(STRESS_MAX_SIZE);
+    auto fail = [&](const string& path, const char* what) {
+        fprintf(stderr, "stress remote %s: %s\n", path.c_str(), what);
+        errors ++;
+    };
+    auto packet = [&](int32_t type, const string& path, size_t extra) {
+        PacketHead head;
+        memset(&head, 0, sizeof(head));
+        head.type = type;
+        head.time = time(NULL);
+        strncpy(head.filename, path.c_str(), FILENAME_MAX_SIZE - 1);
+        data_t data = CreateBuffer(sizeof(head) + extra);
+        memcpy(data->data(), &head, sizeof(head));
+        return data;
+    };
+
+    auto start = chrono::steady_clock::now();
+    while (Seconds(start) < seconds) {
+        uint32_t op = next(100);
+        int index = next(STRESS_REMOTE_FILES);
+        bool shared = op >= 80;
+        string path = shared ? root + "/shared" + to_string(next(STRESS_SHARED_FILES)) : root + "/remote" + to_string(index);
+        if (op < 2) { // 上线：把所有文件广播一遍
+            control.HandlePacket(Slice(packet(packet_type_online, "bench", 0)));
+        } else if (op % 10 == 0) {
+            control.HandlePacket(Slice(packet(packet_type_delete, path, 0)));
+            if (!shared) expect[index].clear();
+        } else {
+            // 和BroadcastFile一样，写到文件末尾的包按16字节补齐，只有file_size以内的部分有效
+            uint64_t offset = next(STRESS_MAX_SIZE);
+            size_t size = 1 + next(STRESS_MAX_SIZE - offset);
+            uint64_t file_size = max((uint64_t)(shared ? 0 : expect[index].size()), offset + size);
+            if (next(4) == 0) file_size = offset + size; // 同时截短
+            ModifyPacket modify;
+            modify.file_size = file_size;
+            modify.payload_offset = offset;
+            modify.payload_size = offset + size == file_size ? (size + 15) / 16 * 16 : size;
+            modify.total_size = max((uint64_t)(file_size + 15) / 16 * 16, (uint64_t)(offset + modify.payload_size));
+            data_t data = packet(packet_type_modify, path, sizeof(modify) + modify.payload_size);
+            uint8_t* payload = data->data() + sizeof(PacketHead) + sizeof(modify);
+            memcpy(data->data() + sizeof(PacketHead), &modify, sizeof(modify));
+            for(size_t i = 0; i < (size_t)modify.payload_size; i ++) payload[i] = i < size ? (uint8_t)next(256) : 0;
+            control.HandlePacket(Slice(data));
+            if (!shared) {
+                expect[index].resize(file_size, 0);
+                memcpy(expect[index].data() + offset, payload, size);
+            }
+        }
+        ops ++;
+        if (shared || op < 2) continue;
+
+        // 删除之后没有这个文件，否则长度和内容都和收到的一样
+        struct stat st;
+        int res = control.Stat(path.c_str(), &st);
+        if (op % 10 == 0) {
+            if (res != -1) fail(path, "deleted file still exists");
+            continue;
+        }
+        if (res == -1 || (uint64_t)st.st_size != expect[index].size()) {
+            fail(path, "size mismatch");
+            continue;
+        }
+        if (control.ReadFile(path.c_str(), -1, (char*)buf.data(), expect[index].size(), 0) != (int)expect[index].size() ||
+            memcmp(buf.data(), expect[index].data(), expect[index].size()) != 0) fail(path, "read mismatch");
+    }
+}
+
+// remote不为空时另开一个线程同时运行，比如StressRemote
+static void RunStress(const string& name, StressFs& fs, int threads, double seconds,
+                      function<void(double, atomic<uint64_t>&, atomic<uint64_t>&)> remote = nullptr)
+{
+    atomic<uint64_t> ops(0), errors(0);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < threads; i ++) {
+        workers.push_back(thread([&, i]() { StressWorker(fs, i, seconds, ops, errors); }));
+    }
+    if (remote) workers.push_back(thread([&]() { remote(seconds, ops, errors); }));
+    for(auto& worker : workers) worker.join();
+    double elapsed = Seconds(start);
+
+    printf("%s\t0\t0.0\t%.1f\t0.00\t0.0\n", name.c_str(), elapsed * 1e9 / max((uint64_t)1, (uint64_t)ops));
+    printf("# %s: %lu ops, %lu errors\n", name.c_str(), (unsigned long)ops, (unsigned long)errors);
+    fflush(stdout);
+    if (errors > 0) {
+        fprintf(stderr, "%s failed\n", name.c_str());
+        exit(1);
+    }
+}
+
+// 只在过滤字符串以stress开头时运行
+static void BenchStress(const char* mount)
+{
+    if (filter.compare(0, 6, "stress") != 0) return;
+    const int threads = 16;
+
+    if (mount != NULL) {
+        string root = string(mount) + "/stress-" + to_string(getpid());
+        if (mkdir(root.c_str(), 0777) == -1) {
+            perror("mkdir");
+            exit(1);
+        }
+        MountFs fs(root);
+        RunStress("stress_mount/" + to_string(threads), fs, threads, 10);
+        for(int i = 0; i < STRESS_SHARED_FILES; i ++) unlink((root + "/shared" + to_string(i)).c_str());
+        rmdir(root.c_str());
+        return;
+    }
+
+    char dir[] = "/tmp/sharedisk-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    {
+        // 缓存很小，读写时经常淘汰和写回别的线程的文件
+        int cache_size = options.cache_size;
+        options.cache_size = 1;
+        FileControl control(dir, vector<string>(1, "bench:benchkey"));
+        control.SetSender(DropPackets);
+        options.cache_size = cache_size;
+        mkdir(control.Resolve(".blockmap").c_str(), S_IRWXU);
+        mkdir(control.Resolve("bench").c_str(), S_IRWXU);
+        mkdir(control.Resolve("bench/stress").c_str(), S_IRWXU);
+        // 后台同步照常运行，收到的包由StressRemote注入
+        control.StartSyncThread();
+        ControlFs fs(control);
+        RunStress("stress_control/" + to_string(threads), fs, threads, 3, [&](double seconds, atomic<uint64_t>& ops, atomic<uint64_t>& errors) {
+            StressRemote(control, fs.Root(), seconds, ops, errors);
+        });
+    }
+    system((string("rm -rf ") + dir).c_str());
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1) filter = argv[1];
+
+    if (!aes_self_test()) {
+        fprintf(stderr, "aes_self_test failed\n");
+        return 1;
+    }
+    if (!aes_gcm_self_test()) {
+        fprintf(stderr, "aes_gcm_self_test failed\n");
+        return 1;
+    }
+
+    printf("# aes backend: %s\n", aes_backend_name());
+    printf("# hardware threads: %u\n", thread::hardware_concurrency());
+    printf("benchmark\tbytes\tMB/s\tns/op\tallocs/op\tallocs/MB\n");
+
+    BenchAes();
+    BenchParallel(64 << 20);
+    BenchPacket();
+    BenchFile();
+    BenchCache();
+    BenchReadahead();
+    BenchWriteback();
+    BenchBlockFile();
+    BenchMeta();
+    BenchData();
+    BenchStress(argc > 2 ? argv[2] : NULL);
+    return 0;
+}
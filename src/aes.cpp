@@ -8,8 +8,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "aes.h"
+#include "aes_ni.h"
+#include "aes_bitsliced.h"
+#include "aes_table.h"
 
 /*
  * Addition in GF(2^8)
@@ -450,44 +454,204 @@ void inv_cipher(uint8_t *in, uint8_t *out, uint8_t *w) {
 	}
 }
 
-void aes_encode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out)
+/*
+ * Byte-wise reference implementation, kept for the self test and benchmarks.
+ * key->enc is exactly the w[] produced by key_expansion().
+ */
+static void aes_bytewise_expand_key(const uint8_t* key, AesKey* expanded)
 {
-	if (keylen != 32) {
-		fprintf(stderr, "aes_encode: keylen must equal 32\n");
-		exit(1);
-	}
-	if (inlen % 16 != 0) {
-		fprintf(stderr, "aes_encode: inlen %% 16 must equal 0\n");
-		exit(1);
+	key_expansion(const_cast<uint8_t*>(key), expanded->enc);
+
+	// key->dec is only used by the other backends, filled in so they can share keys
+	memcpy(expanded->dec, expanded->enc+16*AES_ROUNDS, 16);
+	for (int r = 1; r < AES_ROUNDS; r++) {
+		const uint8_t* rk = expanded->enc+16*(AES_ROUNDS-r);
+		uint8_t state[4*Nb];
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < Nb; j++) {
+				state[Nb*i+j] = rk[i+4*j];
+			}
+		}
+		inv_mix_columns(state);
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < Nb; j++) {
+				expanded->dec[16*r+i+4*j] = state[Nb*i+j];
+			}
+		}
 	}
+	memcpy(expanded->dec+16*AES_ROUNDS, expanded->enc, 16);
+}
 
-	uint8_t* w = (uint8_t*)malloc(Nb*(Nr+1)*4);; // expanded key
-	key_expansion(const_cast<uint8_t*>(key), w);
+static void aes_bytewise_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+	for(size_t offset = 0; offset < inlen; offset += 16) {
+		cipher(const_cast<uint8_t*>(in)+offset /* in */, out+offset /* out */, const_cast<uint8_t*>(key.enc) /* expanded key */);
+	}
+}
 
+static void aes_bytewise_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
 	for(size_t offset = 0; offset < inlen; offset += 16) {
-		cipher(const_cast<uint8_t*>(in)+offset /* in */, out+offset /* out */, w /* expanded key */);
+		inv_cipher(const_cast<uint8_t*>(in)+offset /* in */, out+offset /* out */, const_cast<uint8_t*>(key.enc) /* expanded key */);
 	}
+}
+
+typedef void (*aes_expand_func_t)(const uint8_t* key, AesKey* expanded);
+typedef void (*aes_func_t)(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
 
-	free(w);
+static bool always_supported()
+{
+	return true;
 }
 
-void aes_decode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out)
+/*
+ * Backends in order of preference for "auto". Every backend produces the
+ * same AesKey layout, so keys expanded by one can be used by another.
+ * "bitsliced" comes before "table" because it is constant time, not because
+ * it is faster: it costs a full 8-block batch even for one block and is
+ * slower than the T-tables in bulk, decode about twice as slow again.
+ * "bytewise" is never picked by "auto"; it is kept for comparison only.
+ */
+static const struct AesBackend {
+	const char* name;
+	aes_expand_func_t expand;
+	aes_func_t encode, decode;
+	bool (*supported)();
+} backends[] = {
+	{"aes-ni", aes_ni_expand_key, aes_ni_encode, aes_ni_decode, aes_ni_supported},
+	{"bitsliced", aes_bitsliced_expand_key, aes_bitsliced_encode, aes_bitsliced_decode, aes_bitsliced_supported},
+	{"table", aes_table_expand_key, aes_table_encode, aes_table_decode, always_supported},
+	{"bytewise", aes_bytewise_expand_key, aes_bytewise_encode, aes_bytewise_decode, always_supported},
+};
+
+static const AesBackend* auto_backend()
+{
+	for(size_t i = 0; i < sizeof(backends)/sizeof(backends[0]); i ++) {
+		if (backends[i].supported()) return &backends[i];
+	}
+	return NULL;
+}
+
+static const AesBackend*& current_backend()
+{
+	static const AesBackend* backend = auto_backend();
+	return backend;
+}
+
+bool aes_select_backend(const char* name)
+{
+	if (strcmp(name, "auto") == 0) {
+		current_backend() = auto_backend();
+		return true;
+	}
+	for(size_t i = 0; i < sizeof(backends)/sizeof(backends[0]); i ++) {
+		if (strcmp(name, backends[i].name) == 0 && backends[i].supported()) {
+			current_backend() = &backends[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* aes_backend_name()
+{
+	return current_backend()->name;
+}
+
+void aes_expand_key(const uint8_t* key, size_t keylen, AesKey* expanded)
 {
 	if (keylen != 32) {
-		fprintf(stderr, "aes_decode: keylen must equal 32\n");
+		fprintf(stderr, "aes_expand_key: keylen must equal 32\n");
 		exit(1);
 	}
+
+	current_backend()->expand(key, expanded);
+	// 之后可能换成查表实现(见aes_select_backend)
+	if (current_backend()->expand != aes_table_expand_key) aes_table_load_words(expanded);
+}
+
+void aes_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+	if (inlen % 16 != 0) {
+		fprintf(stderr, "aes_encode: inlen %% 16 must equal 0\n");
+		exit(1);
+	}
+
+	current_backend()->encode(key, in, inlen, out);
+}
+
+void aes_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
 	if (inlen % 16 != 0) {
 		fprintf(stderr, "aes_decode: inlen %% 16 must equal 0\n");
 		exit(1);
 	}
 
-	uint8_t* w = (uint8_t*)malloc(Nb*(Nr+1)*4);; // expanded key
-	key_expansion(const_cast<uint8_t*>(key), w);
+	current_backend()->decode(key, in, inlen, out);
+}
 
-	for(size_t offset = 0; offset < inlen; offset += 16) {
-		inv_cipher(const_cast<uint8_t*>(in)+offset /* in */, out+offset /* out */, w /* expanded key */);
+void aes_encode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+	AesKey expanded;
+	aes_expand_key(key, keylen, &expanded);
+	aes_encode(expanded, in, inlen, out);
+}
+
+void aes_decode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+	AesKey expanded;
+	aes_expand_key(key, keylen, &expanded);
+	aes_decode(expanded, in, inlen, out);
+}
+
+/*
+ * Known answer test: FIPS-197 Appendix C.3 (AES-256) for every backend,
+ * plus a cross check of each backend against the byte-wise code on
+ * pseudo random data so that files written by older versions stay readable.
+ */
+bool aes_self_test()
+{
+	static const uint8_t fips_key[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
+	static const uint8_t fips_plain[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+	static const uint8_t fips_cipher[16] = {
+		0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89};
+
+	// 37 blocks: not a multiple of the 8-block pipelines, so tails are covered too
+	const size_t len = 37*16;
+	uint8_t key[32], plain[len], expect[len], out[len];
+	uint32_t seed = 0x2545f491;
+	for(size_t i = 0; i < sizeof(key); i ++) key[i] = (uint8_t)((seed = seed*1103515245+12345) >> 16);
+	for(size_t i = 0; i < len; i ++) plain[i] = (uint8_t)((seed = seed*1103515245+12345) >> 16);
+	AesKey fips_expanded, expanded, reference;
+	aes_bytewise_expand_key(key, &reference);
+	aes_bytewise_encode(reference, plain, len, expect);
+
+	for(size_t b = 0; b < sizeof(backends)/sizeof(backends[0]); b ++) {
+		const AesBackend& backend = backends[b];
+		if (!backend.supported()) continue;
+
+		backend.expand(fips_key, &fips_expanded);
+		backend.encode(fips_expanded, fips_plain, 16, out);
+		bool ok = memcmp(out, fips_cipher, 16) == 0;
+		backend.decode(fips_expanded, fips_cipher, 16, out);
+		ok = ok && memcmp(out, fips_plain, 16) == 0;
+
+		backend.expand(key, &expanded);
+		ok = ok && memcmp(expanded.enc, reference.enc, sizeof(reference.enc)) == 0;
+		ok = ok && memcmp(expanded.dec, reference.dec, sizeof(reference.dec)) == 0;
+		backend.encode(expanded, plain, len, out);
+		ok = ok && memcmp(out, expect, len) == 0;
+		backend.decode(expanded, expect, len, out);
+		ok = ok && memcmp(out, plain, len) == 0;
+
+		if (!ok) {
+			fprintf(stderr, "aes_self_test: backend %s failed\n", backend.name);
+			return false;
+		}
 	}
 
-	free(w);
+	return true;
 }
@@ -6,12 +6,40 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-// AES加密/解密
+#define AES_ROUNDS 14 // AES-256
+#define AES_SCHEDULE_SIZE (16*(AES_ROUNDS+1))
+
+// 扩展后的密钥，由aes_expand_key生成一次后反复使用
+struct AesKey
+{
+    alignas(16) uint8_t enc[AES_SCHEDULE_SIZE]; // 加密轮密钥，即FIPS-197中的w
+    alignas(16) uint8_t dec[AES_SCHEDULE_SIZE]; // 等价逆密码(Equivalent Inverse Cipher)的解密轮密钥
+    // 同enc/dec，按本机字节序存成32位字，给查表实现每轮直接使用
+    uint32_t enc_words[AES_SCHEDULE_SIZE/4];
+    uint32_t dec_words[AES_SCHEDULE_SIZE/4];
+};
+
 // key必须为256位(keylen=32)
+void aes_expand_key(const uint8_t* key, size_t keylen, AesKey* expanded);
+
+// AES加密/解密
 // inlen必须为16的倍数
 // out的空间必须和in的空间一样大
+void aes_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
 
+// 同上，但每次调用都要扩展密钥，只适合偶尔调用的场合
 void aes_encode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out);
 void aes_decode(const uint8_t* key, size_t keylen, const uint8_t* in, size_t inlen, uint8_t* out);
 
+// 选择使用的实现："auto"(默认，依次选择aes-ni、bitsliced、table中第一个可用的)、"aes-ni"、"bitsliced"、"table"
+// 以及只用于对比性能的"bytewise"(最初的逐字节实现)
+// 名字不对或CPU不支持时返回false
+// 在启动时调用，不能和加解密同时进行
+bool aes_select_backend(const char* name);
+const char* aes_backend_name(); // 当前使用的实现
+
+// 用FIPS-197的测试向量检查所有可用的实现，并与最初的逐字节实现交叉比对
+bool aes_self_test();
+
 #endif // _AES_H_
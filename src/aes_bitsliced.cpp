@@ -0,0 +1,489 @@
+#include "aes_bitsliced.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+// 8个块共128字节，转置后放在8个寄存器q[0..7]中：
+// q[i]的第k个字节的第j位 = 第j个块第k个字节的第i位
+// 于是SubBytes是对8个寄存器做布尔运算，ShiftRows和MixColumns中的行列移动是对每个寄存器做pshufb
+
+#define AES_BS_TARGET __attribute__((target("ssse3")))
+#define AES_BS_BLOCKS 8
+
+bool aes_bitsliced_supported()
+{
+    static const bool supported = []() {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+        return (ecx & bit_SSSE3) != 0 && (edx & bit_SSE2) != 0;
+    }();
+    return supported;
+}
+
+// 交换a中第p+n位和b中第p位(p为mask中的位)
+#define SWAPMOVE(a, b, n, mask) do { \
+        __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srli_epi64(a, n), b), mask); \
+        b = _mm_xor_si128(b, t); \
+        a = _mm_xor_si128(a, _mm_slli_epi64(t, n)); \
+    } while (0)
+
+// 在每个字节内做8x8的位矩阵转置，再做一次即还原
+AES_BS_TARGET static inline void transpose(__m128i* q)
+{
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+
+    SWAPMOVE(q[0], q[1], 1, m1);
+    SWAPMOVE(q[2], q[3], 1, m1);
+    SWAPMOVE(q[4], q[5], 1, m1);
+    SWAPMOVE(q[6], q[7], 1, m1);
+
+    SWAPMOVE(q[0], q[2], 2, m2);
+    SWAPMOVE(q[1], q[3], 2, m2);
+    SWAPMOVE(q[4], q[6], 2, m2);
+    SWAPMOVE(q[5], q[7], 2, m2);
+
+    SWAPMOVE(q[0], q[4], 4, m4);
+    SWAPMOVE(q[1], q[5], 4, m4);
+    SWAPMOVE(q[2], q[6], 4, m4);
+    SWAPMOVE(q[3], q[7], 4, m4);
+}
+
+#undef SWAPMOVE
+
+// 16字节扩展成8个寄存器，每个字节为0x00或0xff，相当于8个块都是同样的数据
+AES_BS_TARGET static inline void broadcast(const uint8_t* in, __m128i* q)
+{
+    __m128i x = _mm_loadu_si128((const __m128i*)in);
+    for(int i = 0; i < 8; i ++) {
+        __m128i bit = _mm_set1_epi8((char)(1 << i));
+        q[i] = _mm_cmpeq_epi8(_mm_and_si128(x, bit), bit);
+    }
+}
+
+// broadcast的逆操作
+AES_BS_TARGET static inline void gather(const __m128i* q, uint8_t* out)
+{
+    int mask[8];
+    for(int i = 0; i < 8; i ++) mask[i] = _mm_movemask_epi8(q[i]);
+    for(int k = 0; k < 16; k ++) {
+        uint8_t x = 0;
+        for(int i = 0; i < 8; i ++) x |= ((mask[i] >> k) & 1) << i;
+        out[k] = x;
+    }
+}
+
+// S盒：Boyar和Peralta的113门电路(GF(2^8)求逆 + 仿射变换)
+AES_BS_TARGET static void sub_bytes(__m128i* q)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7;
+    __m128i y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    __m128i y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    __m128i y20, y21;
+    __m128i z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    __m128i z10, z11, z12, z13, z14, z15, z16, z17;
+    __m128i t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    __m128i t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    __m128i t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    __m128i t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    __m128i t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    __m128i t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    __m128i t60, t61, t62, t63, t64, t65, t66, t67;
+    __m128i s0, s1, s2, s3, s4, s5, s6, s7;
+
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define AND(a, b) _mm_and_si128(a, b)
+#define XNOR(a, b) _mm_xor_si128(_mm_xor_si128(a, b), ones)
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // 上层线性变换
+    y14 = XOR(x3, x5);
+    y13 = XOR(x0, x6);
+    y9 = XOR(x0, x3);
+    y8 = XOR(x0, x5);
+    t0 = XOR(x1, x2);
+    y1 = XOR(t0, x7);
+    y4 = XOR(y1, x3);
+    y12 = XOR(y13, y14);
+    y2 = XOR(y1, x0);
+    y5 = XOR(y1, x6);
+    y3 = XOR(y5, y8);
+    t1 = XOR(x4, y12);
+    y15 = XOR(t1, x5);
+    y20 = XOR(t1, x1);
+    y6 = XOR(y15, x7);
+    y10 = XOR(y15, t0);
+    y11 = XOR(y20, y9);
+    y7 = XOR(x7, y11);
+    y17 = XOR(y10, y11);
+    y19 = XOR(y10, y8);
+    y16 = XOR(t0, y11);
+    y21 = XOR(y13, y16);
+    y18 = XOR(x0, y16);
+
+    // 非线性部分
+    t2 = AND(y12, y15);
+    t3 = AND(y3, y6);
+    t4 = XOR(t3, t2);
+    t5 = AND(y4, x7);
+    t6 = XOR(t5, t2);
+    t7 = AND(y13, y16);
+    t8 = AND(y5, y1);
+    t9 = XOR(t8, t7);
+    t10 = AND(y2, y7);
+    t11 = XOR(t10, t7);
+    t12 = AND(y9, y11);
+    t13 = AND(y14, y17);
+    t14 = XOR(t13, t12);
+    t15 = AND(y8, y10);
+    t16 = XOR(t15, t12);
+    t17 = XOR(t4, t14);
+    t18 = XOR(t6, t16);
+    t19 = XOR(t9, t14);
+    t20 = XOR(t11, t16);
+    t21 = XOR(t17, y20);
+    t22 = XOR(t18, y19);
+    t23 = XOR(t19, y21);
+    t24 = XOR(t20, y18);
+
+    t25 = XOR(t21, t22);
+    t26 = AND(t21, t23);
+    t27 = XOR(t24, t26);
+    t28 = AND(t25, t27);
+    t29 = XOR(t28, t22);
+    t30 = XOR(t23, t24);
+    t31 = XOR(t22, t26);
+    t32 = AND(t31, t30);
+    t33 = XOR(t32, t24);
+    t34 = XOR(t23, t33);
+    t35 = XOR(t27, t33);
+    t36 = AND(t24, t35);
+    t37 = XOR(t36, t34);
+    t38 = XOR(t27, t36);
+    t39 = AND(t29, t38);
+    t40 = XOR(t25, t39);
+
+    t41 = XOR(t40, t37);
+    t42 = XOR(t29, t33);
+    t43 = XOR(t29, t40);
+    t44 = XOR(t33, t37);
+    t45 = XOR(t42, t41);
+    z0 = AND(t44, y15);
+    z1 = AND(t37, y6);
+    z2 = AND(t33, x7);
+    z3 = AND(t43, y16);
+    z4 = AND(t40, y1);
+    z5 = AND(t29, y7);
+    z6 = AND(t42, y11);
+    z7 = AND(t45, y17);
+    z8 = AND(t41, y10);
+    z9 = AND(t44, y12);
+    z10 = AND(t37, y3);
+    z11 = AND(t33, y4);
+    z12 = AND(t43, y13);
+    z13 = AND(t40, y5);
+    z14 = AND(t29, y2);
+    z15 = AND(t42, y9);
+    z16 = AND(t45, y14);
+    z17 = AND(t41, y8);
+
+    // 下层线性变换
+    t46 = XOR(z15, z16);
+    t47 = XOR(z10, z11);
+    t48 = XOR(z5, z13);
+    t49 = XOR(z9, z10);
+    t50 = XOR(z2, z12);
+    t51 = XOR(z2, z5);
+    t52 = XOR(z7, z8);
+    t53 = XOR(z0, z3);
+    t54 = XOR(z6, z7);
+    t55 = XOR(z16, z17);
+    t56 = XOR(z12, t48);
+    t57 = XOR(t50, t53);
+    t58 = XOR(z4, t46);
+    t59 = XOR(z3, t54);
+    t60 = XOR(t46, t57);
+    t61 = XOR(z14, t57);
+    t62 = XOR(t52, t58);
+    t63 = XOR(t49, t58);
+    t64 = XOR(z4, t59);
+    t65 = XOR(t61, t62);
+    t66 = XOR(z1, t63);
+    s0 = XOR(t59, t63);
+    s6 = XNOR(t56, t62);
+    s7 = XNOR(t48, t60);
+    t67 = XOR(t64, t65);
+    s3 = XOR(t53, t66);
+    s4 = XOR(t51, t66);
+    s5 = XOR(t47, t65);
+    s1 = XNOR(t64, s3);
+    s2 = XNOR(t55, t67);
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+
+#undef XOR
+#undef AND
+#undef XNOR
+}
+
+// 仿射变换的逆：b_i = a_{i+2} ^ a_{i+5} ^ a_{i+7} ^ 0x05_i
+AES_BS_TARGET static inline void inv_affine(__m128i* q)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i a[8];
+    for(int i = 0; i < 8; i ++) a[i] = q[i];
+    for(int i = 0; i < 8; i ++) {
+        q[i] = _mm_xor_si128(_mm_xor_si128(a[(i+2)%8], a[(i+5)%8]), a[(i+7)%8]);
+    }
+    q[0] = _mm_xor_si128(q[0], ones);
+    q[2] = _mm_xor_si128(q[2], ones);
+}
+
+// S(x) = A(x^-1) + 0x63，所以 S^-1(y) = A^-1(S(A^-1(y)))，A^-1已包含常数
+AES_BS_TARGET static void inv_sub_bytes(__m128i* q)
+{
+    inv_affine(q);
+    sub_bytes(q);
+    inv_affine(q);
+}
+
+// 状态字节k位于第k%4行、第k/4列
+// 取第k个字节时，pshufb的掩码为 _mm_set_epi8(k15, ..., k0)
+#define SHUFFLE_MASK(f) _mm_set_epi8(f(15), f(14), f(13), f(12), f(11), f(10), f(9), f(8), \
+                                     f(7), f(6), f(5), f(4), f(3), f(2), f(1), f(0))
+#define SHIFT_ROWS(k) ((k)%4 + 4*(((k)/4 + (k)%4) % 4))
+#define INV_SHIFT_ROWS(k) ((k)%4 + 4*(((k)/4 - (k)%4 + 4) % 4))
+#define ROTATE_ROW1(k) (((k)%4 + 1) % 4 + 4*((k)/4)) // 同一列中的下一行
+#define ROTATE_ROW2(k) (((k)%4 + 2) % 4 + 4*((k)/4))
+
+AES_BS_TARGET static inline void shuffle(__m128i* q, __m128i mask)
+{
+    for(int i = 0; i < 8; i ++) q[i] = _mm_shuffle_epi8(q[i], mask);
+}
+
+// 乘以x(即GF(2^8)中的2)：x^8 = x^4 + x^3 + x + 1
+AES_BS_TARGET static inline void xtime(const __m128i* a, __m128i* out)
+{
+    __m128i top = a[7];
+    out[7] = a[6];
+    out[6] = a[5];
+    out[5] = a[4];
+    out[4] = _mm_xor_si128(a[3], top);
+    out[3] = _mm_xor_si128(a[2], top);
+    out[2] = a[1];
+    out[1] = _mm_xor_si128(a[0], top);
+    out[0] = top;
+}
+
+// out_r = 2*(a_r ^ a_{r+1}) ^ a_{r+1} ^ (a_{r+2} ^ a_{r+3})
+AES_BS_TARGET static void mix_columns(__m128i* q)
+{
+    const __m128i row1 = SHUFFLE_MASK(ROTATE_ROW1);
+    const __m128i row2 = SHUFFLE_MASK(ROTATE_ROW2);
+    __m128i r1[8], t[8], t2[8];
+    for(int i = 0; i < 8; i ++) {
+        r1[i] = _mm_shuffle_epi8(q[i], row1);
+        t[i] = _mm_xor_si128(q[i], r1[i]);
+    }
+    xtime(t, t2);
+    for(int i = 0; i < 8; i ++) {
+        q[i] = _mm_xor_si128(_mm_xor_si128(t2[i], r1[i]), _mm_shuffle_epi8(t[i], row2));
+    }
+}
+
+// InvMixColumns = MixColumns * (1 + 4*(a_r ^ a_{r+2}))
+AES_BS_TARGET static void inv_mix_columns(__m128i* q)
+{
+    const __m128i row2 = SHUFFLE_MASK(ROTATE_ROW2);
+    __m128i t[8], t2[8];
+    for(int i = 0; i < 8; i ++) {
+        t[i] = _mm_xor_si128(q[i], _mm_shuffle_epi8(q[i], row2));
+    }
+    xtime(t, t2);
+    xtime(t2, t);
+    for(int i = 0; i < 8; i ++) {
+        q[i] = _mm_xor_si128(q[i], t[i]);
+    }
+    mix_columns(q);
+}
+
+AES_BS_TARGET static inline void add_round_key(__m128i* q, const __m128i* rk)
+{
+    for(int i = 0; i < 8; i ++) q[i] = _mm_xor_si128(q[i], rk[i]);
+}
+
+AES_BS_TARGET static void sub_word(uint8_t* w)
+{
+    uint8_t block[16] = {0};
+    memcpy(block, w, 4);
+    __m128i q[8];
+    broadcast(block, q);
+    sub_bytes(q);
+    gather(q, block);
+    memcpy(w, block, 4);
+}
+
+// 与FIPS-197中的KeyExpansion相同，SubWord和InvMixColumns也用位切片计算，不查表
+AES_BS_TARGET void aes_bitsliced_expand_key(const uint8_t* key, AesKey* expanded)
+{
+    uint8_t* w = expanded->enc;
+    memcpy(w, key, 32);
+
+    uint8_t rcon = 0x01;
+    for(int i = 8; i < 4*(AES_ROUNDS+1); i ++) {
+        uint8_t temp[4];
+        memcpy(temp, w+4*(i-1), 4);
+        if (i % 8 == 0) {
+            uint8_t t = temp[0];
+            temp[0] = temp[1];
+            temp[1] = temp[2];
+            temp[2] = temp[3];
+            temp[3] = t;
+            sub_word(temp);
+            temp[0] ^= rcon;
+            rcon = (uint8_t)((rcon << 1) ^ (0x1b & (0 - (rcon >> 7))));
+        } else if (i % 8 == 4) {
+            sub_word(temp);
+        }
+        for(int k = 0; k < 4; k ++) w[4*i+k] = w[4*(i-8)+k] ^ temp[k];
+    }
+
+    memcpy(expanded->dec, expanded->enc+16*AES_ROUNDS, 16);
+    for(int i = 1; i < AES_ROUNDS; i ++) {
+        __m128i q[8];
+        broadcast(expanded->enc+16*(AES_ROUNDS-i), q);
+        inv_mix_columns(q);
+        gather(q, expanded->dec+16*i);
+    }
+    memcpy(expanded->dec+16*AES_ROUNDS, expanded->enc, 16);
+}
+
+AES_BS_TARGET static void encrypt_batch(__m128i* q, const __m128i rk[AES_ROUNDS+1][8])
+{
+    const __m128i shift_rows = SHUFFLE_MASK(SHIFT_ROWS);
+
+    add_round_key(q, rk[0]);
+    for(int r = 1; r < AES_ROUNDS; r ++) {
+        sub_bytes(q);
+        shuffle(q, shift_rows);
+        mix_columns(q);
+        add_round_key(q, rk[r]);
+    }
+    sub_bytes(q);
+    shuffle(q, shift_rows);
+    add_round_key(q, rk[AES_ROUNDS]);
+}
+
+// 使用直接的逆密码，只需要加密轮密钥
+AES_BS_TARGET static void decrypt_batch(__m128i* q, const __m128i rk[AES_ROUNDS+1][8])
+{
+    const __m128i inv_shift_rows = SHUFFLE_MASK(INV_SHIFT_ROWS);
+
+    add_round_key(q, rk[AES_ROUNDS]);
+    for(int r = AES_ROUNDS-1; r > 0; r --) {
+        shuffle(q, inv_shift_rows);
+        inv_sub_bytes(q);
+        add_round_key(q, rk[r]);
+        inv_mix_columns(q);
+    }
+    shuffle(q, inv_shift_rows);
+    inv_sub_bytes(q);
+    add_round_key(q, rk[0]);
+}
+
+typedef void (*batch_func_t)(__m128i* q, const __m128i rk[AES_ROUNDS+1][8]);
+
+// 每次处理8个块，最后不足8个块的部分补0
+AES_BS_TARGET static void process(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out, batch_func_t func)
+{
+    __m128i rk[AES_ROUNDS+1][8];
+    for(int r = 0; r <= AES_ROUNDS; r ++) {
+        broadcast(key.enc+16*r, rk[r]);
+    }
+
+    const size_t blocks = inlen / 16;
+    for(size_t i = 0; i < blocks; i += AES_BS_BLOCKS) {
+        size_t count = blocks - i < AES_BS_BLOCKS ? blocks - i : AES_BS_BLOCKS;
+        __m128i q[8];
+        if (count == AES_BS_BLOCKS) {
+            for(int k = 0; k < 8; k ++) q[k] = _mm_loadu_si128((const __m128i*)(in+(i+k)*16));
+        } else {
+            alignas(16) uint8_t buffer[AES_BS_BLOCKS*16] = {0};
+            memcpy(buffer, in+i*16, count*16);
+            for(int k = 0; k < 8; k ++) q[k] = _mm_load_si128((const __m128i*)(buffer+k*16));
+        }
+
+        transpose(q);
+        func(q, rk);
+        transpose(q);
+
+        if (count == AES_BS_BLOCKS) {
+            for(int k = 0; k < 8; k ++) _mm_storeu_si128((__m128i*)(out+(i+k)*16), q[k]);
+        } else {
+            alignas(16) uint8_t buffer[AES_BS_BLOCKS*16];
+            for(int k = 0; k < 8; k ++) _mm_store_si128((__m128i*)(buffer+k*16), q[k]);
+            memcpy(out+i*16, buffer, count*16);
+        }
+    }
+}
+
+void aes_bitsliced_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    process(key, in, inlen, out, encrypt_batch);
+}
+
+void aes_bitsliced_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    process(key, in, inlen, out, decrypt_batch);
+}
+
+#undef SHUFFLE_MASK
+#undef SHIFT_ROWS
+#undef INV_SHIFT_ROWS
+#undef ROTATE_ROW1
+#undef ROTATE_ROW2
+
+#else // 非x86平台，总是使用aes.cpp中的实现
+
+bool aes_bitsliced_supported()
+{
+    return false;
+}
+
+void aes_bitsliced_expand_key(const uint8_t* key, AesKey* expanded)
+{
+    abort();
+}
+
+void aes_bitsliced_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    abort();
+}
+
+void aes_bitsliced_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    abort();
+}
+
+#endif
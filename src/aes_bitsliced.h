@@ -0,0 +1,19 @@
+#ifndef _AES_BITSLICED_H_
+#define _AES_BITSLICED_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+// 位切片(bitsliced)实现的AES-256，一次处理8个块，输出与aes.cpp中的实现完全一致
+// 不查表，没有依赖密钥或数据的内存访问和分支，用于没有AES-NI的机器
+// 需要SSSE3，调用前需要确认aes_bitsliced_supported()返回true
+
+bool aes_bitsliced_supported(); // CPU是否支持SSSE3，结果在第一次调用时检测并缓存
+
+void aes_bitsliced_expand_key(const uint8_t* key, AesKey* expanded);
+void aes_bitsliced_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_bitsliced_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+
+#endif // _AES_BITSLICED_H_
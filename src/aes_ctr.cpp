@@ -0,0 +1,60 @@
+#include "aes_ctr.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+#define AES_CTR_BATCH 8 // 每次生成的密钥流块数，和AES-NI、bitsliced一次并行处理的块数相同
+
+// 计数器的低64位按大端写入
+static inline void store_be64(uint8_t* p, uint64_t x)
+{
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+    memcpy(p, &x, 8);
+#else
+    for(int i = 7; i >= 0; i --, x >>= 8) p[i] = (uint8_t)x;
+#endif
+}
+
+void aes_ctr_xor(const AesKey& key, const uint8_t* nonce, uint64_t offset, const uint8_t* in, size_t len, uint8_t* out)
+{
+    uint8_t counters[AES_CTR_BATCH*16];
+    uint8_t stream[AES_CTR_BATCH*16];
+
+    uint64_t block = offset / 16;
+    size_t skip = offset % 16; // 第一个块中需要跳过的字节数
+    size_t done = 0;
+
+    size_t prepared = min((size_t)AES_CTR_BATCH, (skip + len + 15) / 16); // nonce部分只需要写一次
+    for(size_t i = 0; i < prepared; i ++) {
+        memcpy(counters+16*i, nonce, AES_CTR_NONCE_SIZE);
+    }
+
+    while (done < len) {
+        size_t bytes = min((size_t)AES_CTR_BATCH*16 - skip, len - done);
+        size_t blocks = (skip + bytes + 15) / 16;
+
+        for(size_t i = 0; i < blocks; i ++) {
+            store_be64(counters+16*i+AES_CTR_NONCE_SIZE, block + i);
+        }
+        aes_encode(key, counters, blocks*16, stream);
+
+        const uint8_t* ks = stream + skip;
+        size_t i = 0;
+        for(; i + 8 <= bytes; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, in+done+i, 8);
+            memcpy(&b, ks+i, 8);
+            a ^= b;
+            memcpy(out+done+i, &a, 8);
+        }
+        for(; i < bytes; i ++) {
+            out[done+i] = in[done+i] ^ ks[i];
+        }
+
+        done += bytes;
+        block += blocks;
+        skip = 0;
+    }
+}
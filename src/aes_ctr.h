@@ -0,0 +1,17 @@
+#ifndef _AES_CTR_H_
+#define _AES_CTR_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#define AES_CTR_NONCE_SIZE 8
+
+// AES-CTR模式，加密和解密是同一个操作
+// 第i个16字节块的计数器为 nonce(8字节) || i(64位大端)
+// offset是in[0]在整个流中的位置，可以不是16的倍数，所以可以只处理任意一段数据
+// in和out可以是同一块内存
+void aes_ctr_xor(const AesKey& key, const uint8_t* nonce, uint64_t offset, const uint8_t* in, size_t len, uint8_t* out);
+
+#endif // _AES_CTR_H_
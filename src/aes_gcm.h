@@ -0,0 +1,40 @@
+#ifndef _AES_GCM_H_
+#define _AES_GCM_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "aes.h"
+
+// AES-GCM认证加密(NIST SP 800-38D)，IV固定为96位
+// 加密和GHASH按批交替进行，数据只需要遍历一遍；支持PCLMULQDQ时用它计算GHASH
+
+#define AES_GCM_IV_SIZE 12
+#define AES_GCM_TAG_SIZE 16
+
+struct AesGcmKey
+{
+    AesKey aes;
+    uint8_t h[16]; // GHASH的密钥 H = E(K, 0^128)
+    uint8_t h_powers[4][16]; // H^1..H^4，PCLMULQDQ一次处理4个块时使用
+};
+
+void aes_gcm_init(const AesKey& key, AesGcmKey* gcm);
+
+void aes_gcm_encrypt(const AesGcmKey& key, const uint8_t* iv, const uint8_t* aad, size_t aadlen,
+                     const uint8_t* in, size_t len, uint8_t* out, uint8_t* tag);
+
+// 明文分散在多段内存中，依次拼起来加密到连续的out，和先复制到一起再加密的结果相同
+// 每批先把这一批的明文复制到out中再原地加密，数据仍然只遍历一遍
+void aes_gcm_encrypt_gather(const AesGcmKey& key, const uint8_t* iv, const uint8_t* aad, size_t aadlen,
+                            const struct iovec* in, size_t count, uint8_t* out, uint8_t* tag);
+
+// 认证失败时返回false，并把out清零
+bool aes_gcm_decrypt(const AesGcmKey& key, const uint8_t* iv, const uint8_t* aad, size_t aadlen,
+                     const uint8_t* in, size_t len, uint8_t* out, const uint8_t* tag);
+
+// 用McGrew-Viega的测试向量检查加密、分段加密和解密，支持PCLMULQDQ时再和逐位计算的GHASH交叉比对
+bool aes_gcm_self_test();
+
+#endif // _AES_GCM_H_
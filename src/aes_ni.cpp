@@ -0,0 +1,157 @@
+#include "aes_ni.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#define AES_NI_PIPELINE 8 // 同时处理的块数，用来掩盖aesenc/aesdec的延迟
+
+bool aes_ni_supported()
+{
+    static const bool supported = []() {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+        return (ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0;
+    }();
+    return supported;
+}
+
+AES_NI_TARGET static inline __m128i expand_assist(__m128i a, __m128i b)
+{
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+    a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+    return _mm_xor_si128(a, b);
+}
+
+// aeskeygenassist的rcon必须是立即数，所以用宏展开
+#define EXPAND_EVEN(i, rcon) \
+    rk[i] = expand_assist(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff))
+#define EXPAND_ODD(i) \
+    rk[i] = expand_assist(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], 0x00), 0xaa))
+
+AES_NI_TARGET static void expand_encrypt_key(const uint8_t* key, __m128i* rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i*)key);
+    rk[1] = _mm_loadu_si128((const __m128i*)(key+16));
+    EXPAND_EVEN(2, 0x01);  EXPAND_ODD(3);
+    EXPAND_EVEN(4, 0x02);  EXPAND_ODD(5);
+    EXPAND_EVEN(6, 0x04);  EXPAND_ODD(7);
+    EXPAND_EVEN(8, 0x08);  EXPAND_ODD(9);
+    EXPAND_EVEN(10, 0x10); EXPAND_ODD(11);
+    EXPAND_EVEN(12, 0x20); EXPAND_ODD(13);
+    EXPAND_EVEN(14, 0x40);
+}
+
+#undef EXPAND_EVEN
+#undef EXPAND_ODD
+
+// 解密使用等价逆密码(Equivalent Inverse Cipher)，中间轮密钥需要做InvMixColumns
+AES_NI_TARGET void aes_ni_expand_key(const uint8_t* key, AesKey* expanded)
+{
+    __m128i rk[AES_ROUNDS+1];
+    expand_encrypt_key(key, rk);
+    for(int i = 0; i <= AES_ROUNDS; i ++) {
+        _mm_store_si128((__m128i*)(expanded->enc+16*i), rk[i]);
+    }
+    _mm_store_si128((__m128i*)expanded->dec, rk[AES_ROUNDS]);
+    for(int i = 1; i < AES_ROUNDS; i ++) {
+        _mm_store_si128((__m128i*)(expanded->dec+16*i), _mm_aesimc_si128(rk[AES_ROUNDS-i]));
+    }
+    _mm_store_si128((__m128i*)(expanded->dec+16*AES_ROUNDS), rk[0]);
+}
+
+AES_NI_TARGET void aes_ni_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    __m128i rk[AES_ROUNDS+1];
+    for(int i = 0; i <= AES_ROUNDS; i ++) {
+        rk[i] = _mm_load_si128((const __m128i*)(key.enc+16*i));
+    }
+
+    const size_t blocks = inlen / 16;
+    size_t i = 0;
+
+    for(; i + AES_NI_PIPELINE <= blocks; i += AES_NI_PIPELINE) {
+        __m128i b[AES_NI_PIPELINE];
+        for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+            b[k] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in+(i+k)*16)), rk[0]);
+        }
+        for(int r = 1; r < AES_ROUNDS; r ++) {
+            for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+                b[k] = _mm_aesenc_si128(b[k], rk[r]);
+            }
+        }
+        for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+            _mm_storeu_si128((__m128i*)(out+(i+k)*16), _mm_aesenclast_si128(b[k], rk[AES_ROUNDS]));
+        }
+    }
+
+    for(; i < blocks; i ++) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in+i*16)), rk[0]);
+        for(int r = 1; r < AES_ROUNDS; r ++) {
+            b = _mm_aesenc_si128(b, rk[r]);
+        }
+        _mm_storeu_si128((__m128i*)(out+i*16), _mm_aesenclast_si128(b, rk[AES_ROUNDS]));
+    }
+}
+
+AES_NI_TARGET void aes_ni_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    __m128i dk[AES_ROUNDS+1];
+    for(int i = 0; i <= AES_ROUNDS; i ++) {
+        dk[i] = _mm_load_si128((const __m128i*)(key.dec+16*i));
+    }
+
+    const size_t blocks = inlen / 16;
+    size_t i = 0;
+
+    for(; i + AES_NI_PIPELINE <= blocks; i += AES_NI_PIPELINE) {
+        __m128i b[AES_NI_PIPELINE];
+        for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+            b[k] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in+(i+k)*16)), dk[0]);
+        }
+        for(int r = 1; r < AES_ROUNDS; r ++) {
+            for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+                b[k] = _mm_aesdec_si128(b[k], dk[r]);
+            }
+        }
+        for(int k = 0; k < AES_NI_PIPELINE; k ++) {
+            _mm_storeu_si128((__m128i*)(out+(i+k)*16), _mm_aesdeclast_si128(b[k], dk[AES_ROUNDS]));
+        }
+    }
+
+    for(; i < blocks; i ++) {
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in+i*16)), dk[0]);
+        for(int r = 1; r < AES_ROUNDS; r ++) {
+            b = _mm_aesdec_si128(b, dk[r]);
+        }
+        _mm_storeu_si128((__m128i*)(out+i*16), _mm_aesdeclast_si128(b, dk[AES_ROUNDS]));
+    }
+}
+
+#else // 非x86平台没有AES-NI，总是使用aes.cpp中的实现
+
+bool aes_ni_supported()
+{
+    return false;
+}
+
+void aes_ni_expand_key(const uint8_t* key, AesKey* expanded)
+{
+    abort();
+}
+
+void aes_ni_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    abort();
+}
+
+void aes_ni_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    abort();
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _AES_NI_H_
+#define _AES_NI_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+// 基于AES-NI指令集的AES-256实现，输出与aes.cpp中的实现完全一致
+// 调用前需要确认aes_ni_supported()返回true
+
+bool aes_ni_supported(); // CPU是否支持AES-NI，结果在第一次调用时检测并缓存
+
+void aes_ni_expand_key(const uint8_t* key, AesKey* expanded);
+void aes_ni_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_ni_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+
+#endif // _AES_NI_H_
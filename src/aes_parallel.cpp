@@ -0,0 +1,83 @@
+#include "aes_parallel.h"
+#include "aes_ctr.h"
+#include "thread_pool.h"
+#include <mutex>
+
+using namespace std;
+
+static mutex pool_mutex;
+static int parallel_workers = 0;
+static ThreadPool* parallel_pool = NULL;
+static bool pool_created = false;
+
+void aes_set_parallel_workers(int workers)
+{
+    lock_guard<mutex> lock(pool_mutex);
+    delete parallel_pool;
+    parallel_pool = NULL;
+    pool_created = false;
+    parallel_workers = workers;
+}
+
+static ThreadPool* pool()
+{
+    lock_guard<mutex> lock(pool_mutex);
+    if (!pool_created) {
+        if (parallel_workers != 1) parallel_pool = new ThreadPool(parallel_workers);
+        pool_created = true;
+    }
+    return parallel_pool;
+}
+
+int aes_parallel_workers()
+{
+    ThreadPool* p = pool();
+    return p == NULL ? 1 : p->Workers();
+}
+
+// 把[0, len)切成AES_PARALLEL_CHUNK大小的段并行执行body(offset, len)
+static void run_parallel(size_t len, function<void(size_t, size_t)> body)
+{
+    ThreadPool* p = len > AES_PARALLEL_THRESHOLD ? pool() : NULL;
+    if (p == NULL) {
+        body(0, len);
+        return;
+    }
+
+    size_t chunks = (len + AES_PARALLEL_CHUNK - 1) / AES_PARALLEL_CHUNK;
+    p->ParallelFor(chunks, [&](size_t i) {
+        size_t offset = i * AES_PARALLEL_CHUNK;
+        body(offset, min((size_t)AES_PARALLEL_CHUNK, len - offset));
+    });
+}
+
+void aes_encode_parallel(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    run_parallel(inlen, [&](size_t offset, size_t len) {
+        aes_encode(key, in+offset, len, out+offset);
+    });
+}
+
+void aes_decode_parallel(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    run_parallel(inlen, [&](size_t offset, size_t len) {
+        aes_decode(key, in+offset, len, out+offset);
+    });
+}
+
+void aes_ctr_xor_parallel(const AesKey& key, const uint8_t* nonce, uint64_t offset, const uint8_t* in, size_t len, uint8_t* out)
+{
+    run_parallel(len, [&](size_t pos, size_t n) {
+        aes_ctr_xor(key, nonce, offset+pos, in+pos, n, out+pos);
+    });
+}
+
+void aes_parallel_for(size_t count, size_t bytes, function<void(size_t)> body)
+{
+    ThreadPool* p = bytes > AES_PARALLEL_THRESHOLD && count > 1 ? pool() : NULL;
+    if (p == NULL) {
+        for(size_t i = 0; i < count; i ++) body(i);
+        return;
+    }
+    p->ParallelFor(count, body);
+}
@@ -0,0 +1,28 @@
+#ifndef _AES_PARALLEL_H_
+#define _AES_PARALLEL_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <functional>
+
+#include "aes.h"
+
+// 大块数据的多线程加密/解密，结果与aes_encode/aes_decode完全相同
+// ECB和CTR模式下每个16字节块互相独立，所以可以把数据切成若干段交给线程池
+// inlen不超过AES_PARALLEL_THRESHOLD时直接在调用线程上执行
+
+#define AES_PARALLEL_THRESHOLD (1024*1024)
+#define AES_PARALLEL_CHUNK (256*1024) // 每个任务处理的字节数，必须是16的倍数
+
+void aes_set_parallel_workers(int workers); // 线程池大小，0表示使用CPU核数，1表示不并行；不能和加解密同时调用
+int aes_parallel_workers();
+
+void aes_encode_parallel(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_decode_parallel(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_ctr_xor_parallel(const AesKey& key, const uint8_t* nonce, uint64_t offset, const uint8_t* in, size_t len, uint8_t* out);
+
+// 并行执行body(0)...body(count-1)，用于各自独立加解密的若干段数据(比如文件的各个块)
+// bytes为总数据量，不超过AES_PARALLEL_THRESHOLD时直接在调用线程上执行
+void aes_parallel_for(size_t count, size_t bytes, std::function<void(size_t)> body);
+
+#endif // _AES_PARALLEL_H_
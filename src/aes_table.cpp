@@ -0,0 +1,197 @@
+#include "aes_table.h"
+
+#define AES_TABLE_KEY_WORDS 8
+#define AES_TABLE_SCHEDULE_WORDS (4*(AES_ROUNDS+1))
+
+#define GETU32(p) (((uint32_t)(p)[0] << 24) ^ ((uint32_t)(p)[1] << 16) ^ ((uint32_t)(p)[2] << 8) ^ ((uint32_t)(p)[3]))
+#define PUTU32(p, v) { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); }
+
+namespace {
+
+// 所有表都在第一次使用时由S盒推导出来，避免手抄8KB常量
+struct Tables
+{
+    uint8_t S[256], Si[256];
+    uint32_t Te[4][256];
+    uint32_t Td[4][256];
+
+    Tables()
+    {
+        // 由GF(2^8)上的乘法逆元和仿射变换构造S盒
+        uint8_t p = 1, q = 1;
+        S[0] = 0x63;
+        do {
+            p = p ^ (uint8_t)(p << 1) ^ (p & 0x80 ? 0x1b : 0); // p *= 3
+            q ^= q << 1; q ^= q << 2; q ^= q << 4; // q /= 3
+            if (q & 0x80) q ^= 0x09;
+            uint8_t x = q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4);
+            S[p] = x ^ 0x63;
+        } while (p != 1);
+
+        for(int i = 0; i < 256; i ++) Si[S[i]] = i;
+
+        for(int i = 0; i < 256; i ++) {
+            uint8_t s = S[i];
+            uint32_t e = ((uint32_t)mul(s, 2) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | mul(s, 3);
+            uint8_t si = Si[i];
+            uint32_t d = ((uint32_t)mul(si, 0x0e) << 24) | ((uint32_t)mul(si, 0x09) << 16) | ((uint32_t)mul(si, 0x0d) << 8) | mul(si, 0x0b);
+            for(int k = 0; k < 4; k ++) {
+                Te[k][i] = ror32(e, 8*k);
+                Td[k][i] = ror32(d, 8*k);
+            }
+        }
+    }
+
+    static uint8_t rotl8(uint8_t x, int n) { return (uint8_t)((x << n) | (x >> (8-n))); }
+    static uint32_t ror32(uint32_t x, int n) { return n == 0 ? x : (x >> n) | (x << (32-n)); }
+    static uint8_t mul(uint8_t a, uint8_t b)
+    {
+        uint8_t p = 0;
+        while (b) {
+            if (b & 1) p ^= a;
+            a = (uint8_t)(a << 1) ^ (a & 0x80 ? 0x1b : 0);
+            b >>= 1;
+        }
+        return p;
+    }
+};
+
+const Tables& tables()
+{
+    static const Tables t;
+    return t;
+}
+
+void expand_encrypt_key(const Tables& T, const uint8_t* key, uint32_t* rk)
+{
+    uint32_t rcon = 0x01;
+    for(int i = 0; i < AES_TABLE_KEY_WORDS; i ++) {
+        rk[i] = GETU32(key + 4*i);
+    }
+    for(int i = AES_TABLE_KEY_WORDS; i < AES_TABLE_SCHEDULE_WORDS; i ++) {
+        uint32_t t = rk[i-1];
+        if (i % AES_TABLE_KEY_WORDS == 0) {
+            t = ((uint32_t)T.S[(t >> 16) & 0xff] << 24) ^ ((uint32_t)T.S[(t >> 8) & 0xff] << 16) ^
+                ((uint32_t)T.S[t & 0xff] << 8) ^ ((uint32_t)T.S[t >> 24]) ^ (rcon << 24);
+            rcon = Tables::mul(rcon, 2);
+        } else if (i % AES_TABLE_KEY_WORDS == 4) {
+            t = ((uint32_t)T.S[t >> 24] << 24) ^ ((uint32_t)T.S[(t >> 16) & 0xff] << 16) ^
+                ((uint32_t)T.S[(t >> 8) & 0xff] << 8) ^ ((uint32_t)T.S[t & 0xff]);
+        }
+        rk[i] = rk[i-AES_TABLE_KEY_WORDS] ^ t;
+    }
+}
+
+// 等价逆密码的轮密钥：轮序反转，中间各轮做InvMixColumns
+void expand_decrypt_key(const Tables& T, const uint32_t* rk, uint32_t* dk)
+{
+    for(int r = 0; r <= AES_ROUNDS; r ++) {
+        for(int c = 0; c < 4; c ++) {
+            uint32_t w = rk[4*(AES_ROUNDS-r)+c];
+            if (r > 0 && r < AES_ROUNDS) {
+                w = T.Td[0][T.S[w >> 24]] ^ T.Td[1][T.S[(w >> 16) & 0xff]] ^
+                    T.Td[2][T.S[(w >> 8) & 0xff]] ^ T.Td[3][T.S[w & 0xff]];
+            }
+            dk[4*r+c] = w;
+        }
+    }
+}
+
+void encrypt_block(const Tables& T, const uint32_t* rk, const uint8_t* in, uint8_t* out)
+{
+    uint32_t s0 = GETU32(in) ^ rk[0];
+    uint32_t s1 = GETU32(in + 4) ^ rk[1];
+    uint32_t s2 = GETU32(in + 8) ^ rk[2];
+    uint32_t s3 = GETU32(in + 12) ^ rk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for(int r = 1; r < AES_ROUNDS; r ++) {
+        rk += 4;
+        t0 = T.Te[0][s0 >> 24] ^ T.Te[1][(s1 >> 16) & 0xff] ^ T.Te[2][(s2 >> 8) & 0xff] ^ T.Te[3][s3 & 0xff] ^ rk[0];
+        t1 = T.Te[0][s1 >> 24] ^ T.Te[1][(s2 >> 16) & 0xff] ^ T.Te[2][(s3 >> 8) & 0xff] ^ T.Te[3][s0 & 0xff] ^ rk[1];
+        t2 = T.Te[0][s2 >> 24] ^ T.Te[1][(s3 >> 16) & 0xff] ^ T.Te[2][(s0 >> 8) & 0xff] ^ T.Te[3][s1 & 0xff] ^ rk[2];
+        t3 = T.Te[0][s3 >> 24] ^ T.Te[1][(s0 >> 16) & 0xff] ^ T.Te[2][(s1 >> 8) & 0xff] ^ T.Te[3][s2 & 0xff] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    rk += 4;
+    t0 = ((uint32_t)T.S[s0 >> 24] << 24) ^ ((uint32_t)T.S[(s1 >> 16) & 0xff] << 16) ^ ((uint32_t)T.S[(s2 >> 8) & 0xff] << 8) ^ T.S[s3 & 0xff] ^ rk[0];
+    t1 = ((uint32_t)T.S[s1 >> 24] << 24) ^ ((uint32_t)T.S[(s2 >> 16) & 0xff] << 16) ^ ((uint32_t)T.S[(s3 >> 8) & 0xff] << 8) ^ T.S[s0 & 0xff] ^ rk[1];
+    t2 = ((uint32_t)T.S[s2 >> 24] << 24) ^ ((uint32_t)T.S[(s3 >> 16) & 0xff] << 16) ^ ((uint32_t)T.S[(s0 >> 8) & 0xff] << 8) ^ T.S[s1 & 0xff] ^ rk[2];
+    t3 = ((uint32_t)T.S[s3 >> 24] << 24) ^ ((uint32_t)T.S[(s0 >> 16) & 0xff] << 16) ^ ((uint32_t)T.S[(s1 >> 8) & 0xff] << 8) ^ T.S[s2 & 0xff] ^ rk[3];
+    PUTU32(out, t0);
+    PUTU32(out + 4, t1);
+    PUTU32(out + 8, t2);
+    PUTU32(out + 12, t3);
+}
+
+void decrypt_block(const Tables& T, const uint32_t* dk, const uint8_t* in, uint8_t* out)
+{
+    uint32_t s0 = GETU32(in) ^ dk[0];
+    uint32_t s1 = GETU32(in + 4) ^ dk[1];
+    uint32_t s2 = GETU32(in + 8) ^ dk[2];
+    uint32_t s3 = GETU32(in + 12) ^ dk[3];
+    uint32_t t0, t1, t2, t3;
+
+    for(int r = 1; r < AES_ROUNDS; r ++) {
+        dk += 4;
+        t0 = T.Td[0][s0 >> 24] ^ T.Td[1][(s3 >> 16) & 0xff] ^ T.Td[2][(s2 >> 8) & 0xff] ^ T.Td[3][s1 & 0xff] ^ dk[0];
+        t1 = T.Td[0][s1 >> 24] ^ T.Td[1][(s0 >> 16) & 0xff] ^ T.Td[2][(s3 >> 8) & 0xff] ^ T.Td[3][s2 & 0xff] ^ dk[1];
+        t2 = T.Td[0][s2 >> 24] ^ T.Td[1][(s1 >> 16) & 0xff] ^ T.Td[2][(s0 >> 8) & 0xff] ^ T.Td[3][s3 & 0xff] ^ dk[2];
+        t3 = T.Td[0][s3 >> 24] ^ T.Td[1][(s2 >> 16) & 0xff] ^ T.Td[2][(s1 >> 8) & 0xff] ^ T.Td[3][s0 & 0xff] ^ dk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    dk += 4;
+    t0 = ((uint32_t)T.Si[s0 >> 24] << 24) ^ ((uint32_t)T.Si[(s3 >> 16) & 0xff] << 16) ^ ((uint32_t)T.Si[(s2 >> 8) & 0xff] << 8) ^ T.Si[s1 & 0xff] ^ dk[0];
+    t1 = ((uint32_t)T.Si[s1 >> 24] << 24) ^ ((uint32_t)T.Si[(s0 >> 16) & 0xff] << 16) ^ ((uint32_t)T.Si[(s3 >> 8) & 0xff] << 8) ^ T.Si[s2 & 0xff] ^ dk[1];
+    t2 = ((uint32_t)T.Si[s2 >> 24] << 24) ^ ((uint32_t)T.Si[(s1 >> 16) & 0xff] << 16) ^ ((uint32_t)T.Si[(s0 >> 8) & 0xff] << 8) ^ T.Si[s3 & 0xff] ^ dk[2];
+    t3 = ((uint32_t)T.Si[s3 >> 24] << 24) ^ ((uint32_t)T.Si[(s2 >> 16) & 0xff] << 16) ^ ((uint32_t)T.Si[(s1 >> 8) & 0xff] << 8) ^ T.Si[s0 & 0xff] ^ dk[3];
+    PUTU32(out, t0);
+    PUTU32(out + 4, t1);
+    PUTU32(out + 8, t2);
+    PUTU32(out + 12, t3);
+}
+
+}
+
+void aes_table_expand_key(const uint8_t* key, AesKey* expanded)
+{
+    const Tables& T = tables();
+    uint32_t rk[AES_TABLE_SCHEDULE_WORDS], dk[AES_TABLE_SCHEDULE_WORDS];
+    expand_encrypt_key(T, key, rk);
+    expand_decrypt_key(T, rk, dk);
+
+    for(int i = 0; i < AES_TABLE_SCHEDULE_WORDS; i ++) {
+        PUTU32(expanded->enc + 4*i, rk[i]);
+        PUTU32(expanded->dec + 4*i, dk[i]);
+        expanded->enc_words[i] = rk[i];
+        expanded->dec_words[i] = dk[i];
+    }
+}
+
+void aes_table_load_words(AesKey* expanded)
+{
+    for(int i = 0; i < AES_TABLE_SCHEDULE_WORDS; i ++) {
+        expanded->enc_words[i] = GETU32(expanded->enc + 4*i);
+        expanded->dec_words[i] = GETU32(expanded->dec + 4*i);
+    }
+}
+
+void aes_table_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    const Tables& T = tables();
+
+    for(size_t offset = 0; offset < inlen; offset += 16) {
+        encrypt_block(T, key.enc_words, in+offset, out+offset);
+    }
+}
+
+void aes_table_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out)
+{
+    const Tables& T = tables();
+
+    for(size_t offset = 0; offset < inlen; offset += 16) {
+        decrypt_block(T, key.dec_words, in+offset, out+offset);
+    }
+}
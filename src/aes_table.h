@@ -0,0 +1,18 @@
+#ifndef _AES_TABLE_H_
+#define _AES_TABLE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+// 查表(T-table)实现的AES-256，每轮以32位字为单位处理，输出与aes.cpp中的实现完全一致
+// 在没有AES-NI的机器上使用
+
+void aes_table_expand_key(const uint8_t* key, AesKey* expanded);
+// 由enc/dec生成enc_words/dec_words，其它实现扩展的密钥也能给查表实现使用
+void aes_table_load_words(AesKey* expanded);
+void aes_table_encode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+void aes_table_decode(const AesKey& key, const uint8_t* in, size_t inlen, uint8_t* out);
+
+#endif // _AES_TABLE_H_
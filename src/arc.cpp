@@ -0,0 +1,101 @@
+#include "arc.h"
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+size_t BlockKeyHash::operator()(const BlockKey& key) const
+{
+    return hash<string>()(key.first) ^ (hash<uint64_t>()(key.second) * 0x9e3779b97f4a7c15ull);
+}
+
+ArcPolicy::ArcPolicy(size_t capacity)
+{
+    this->capacity = max(capacity, (size_t)1);
+    this->p = 0;
+}
+
+bool ArcPolicy::Access(const BlockKey& key)
+{
+    auto it = nodes.find(key);
+    if (it == nodes.end()) {
+        Node node;
+        node.where = T1;
+        lists[T1].push_front(key);
+        node.pos = lists[T1].begin();
+        nodes[key] = node;
+        TrimGhosts();
+        return false;
+    }
+
+    Node& node = it->second;
+    if (node.where == T1 || node.where == T2) {
+        Move(node, T2);
+        return true;
+    }
+
+    // 命中B1说明T1应该更大，命中B2说明T2应该更大
+    size_t b1 = lists[B1].size(), b2 = lists[B2].size();
+    if (node.where == B1) {
+        p = min(capacity, p + max(b2 / b1, (size_t)1));
+    } else {
+        p -= min(p, max(b1 / b2, (size_t)1));
+    }
+    Move(node, T2);
+    TrimGhosts();
+    return false;
+}
+
+bool ArcPolicy::Evict(BlockKey& key)
+{
+    size_t t1 = lists[T1].size(), t2 = lists[T2].size();
+    if (t1 + t2 <= capacity) return false;
+
+    ListId from = t1 > 0 && (t1 > p || t2 == 0) ? T1 : T2;
+    key = lists[from].back();
+    Move(nodes.at(key), from == T1 ? B1 : B2);
+    TrimGhosts();
+    return true;
+}
+
+void ArcPolicy::Erase(const BlockKey& key)
+{
+    auto it = nodes.find(key);
+    if (it == nodes.end()) return;
+    lists[it->second.where].erase(it->second.pos);
+    nodes.erase(it);
+}
+
+void ArcPolicy::Restore(const BlockKey& key)
+{
+    auto it = nodes.find(key);
+    if (it == nodes.end()) {
+        Access(key);
+        return;
+    }
+    if (it->second.where == B1) Move(it->second, T1);
+    else if (it->second.where == B2) Move(it->second, T2);
+}
+
+size_t ArcPolicy::Size() const
+{
+    return lists[T1].size() + lists[T2].size();
+}
+
+void ArcPolicy::Move(Node& node, ListId to)
+{
+    lists[to].splice(lists[to].begin(), lists[node.where], node.pos); // 只移动链表节点，不复制文件名，pos仍然有效
+    node.where = to;
+}
+
+void ArcPolicy::Drop(ListId id)
+{
+    nodes.erase(lists[id].back());
+    lists[id].pop_back();
+}
+
+void ArcPolicy::TrimGhosts()
+{
+    while (!lists[B1].empty() && lists[T1].size() + lists[B1].size() > capacity) Drop(B1);
+    while (!lists[B2].empty() && nodes.size() > 2 * capacity) Drop(B2);
+}
@@ -0,0 +1,54 @@
+#ifndef _ARC_H_
+#define _ARC_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+using namespace std;
+
+typedef pair<string, uint64_t> BlockKey; // 文件名和块号
+
+struct BlockKeyHash
+{
+    size_t operator()(const BlockKey& key) const;
+};
+
+// ARC(Adaptive Replacement Cache)替换策略，只记录键，数据由调用者保存
+// T1中是最近只访问过一次的块，T2中是至少访问过两次的块，B1、B2记录最近从T1、T2中淘汰的块
+// 根据B1、B2的命中情况调整T1的目标大小p，顺序扫描的块只经过T1，不会把T2中常用的块挤出去
+// 淘汰由调用者在操作结束后通过Evict进行，所以缓存的块数可以暂时超过容量
+class ArcPolicy
+{
+public:
+    ArcPolicy(size_t capacity); // 最多缓存的块数
+
+    bool Access(const BlockKey& key); // 记录一次访问，返回是否命中；未命中时视为调用者已经载入了这一块
+    bool Evict(BlockKey& key); // 缓存的块数超过容量时选出一块淘汰，否则返回false
+    void Erase(const BlockKey& key); // 这一块不再存在，比如文件被截短或者删除
+    void Restore(const BlockKey& key); // Evict选出的块暂时不能淘汰时放回，不调整p
+    size_t Size() const; // 缓存中的块数
+
+private:
+    enum ListId { T1, T2, B1, B2 };
+    struct Node
+    {
+        ListId where;
+        list<BlockKey>::iterator pos;
+    };
+
+    void Move(Node& node, ListId to); // 移到to的MRU端，只移动链表节点
+    void Drop(ListId id); // 删除id中LRU端的记录
+    void TrimGhosts(); // 保持|T1|+|B1|<=c，|T1|+|T2|+|B1|+|B2|<=2c
+
+private:
+    size_t capacity;
+    size_t p;
+    list<BlockKey> lists[4]; // 头部为MRU端
+    unordered_map<BlockKey, Node, BlockKeyHash> nodes;
+};
+
+#endif // _ARC_H_
@@ -0,0 +1,263 @@
+#include "block_store.h"
+#include "aes_parallel.h"
+#include "common.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// 块表文件以BlockMapHeader开头，之后第i项是第i块的IV
+static const char map_magic[8] = {'S', 'D', 'B', 'L', 'K', '\0', '\0', '\1'};
+
+struct BlockMapHeader
+{
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+};
+
+static uint64_t map_offset(uint64_t block)
+{
+    return sizeof(BlockMapHeader) + block * BLOCK_IV_SIZE;
+}
+
+static bool is_hole(const uint8_t* iv)
+{
+    for(int i = 0; i < BLOCK_IV_SIZE; i ++)
+        if (iv[i] != 0) return false;
+    return true;
+}
+
+// pread/pwrite可能只处理了一部分，循环直到完成；读到文件末尾时返回实际读到的字节数
+static ssize_t pread_full(int fd, uint8_t* buf, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = pread(fd, buf+done, size-done, offset+done);
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1) return -1;
+        if (res == 0) break;
+        done += res;
+    }
+    return done;
+}
+
+static ssize_t pwrite_full(int fd, const uint8_t* buf, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = pwrite(fd, buf+done, size-done, offset+done);
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1) return -1;
+        done += res;
+    }
+    return done;
+}
+
+BlockFile::BlockFile(const AesKey& key) : key(key), data_fd(-1), map_fd(-1)
+{
+}
+
+BlockFile::~BlockFile()
+{
+    Close();
+}
+
+int BlockFile::Open(const string& data_path, const string& map_path, bool writable)
+{
+    Close();
+
+    int flags = writable ? O_RDWR|O_CREAT : O_RDONLY;
+    data_fd = open(data_path.c_str(), flags, 0666);
+    if (data_fd == -1) return -1;
+
+    map_fd = open(map_path.c_str(), flags, 0600);
+    if (map_fd == -1) {
+        if (!writable && errno == ENOENT) return 0; // 没有写入过任何块
+        int err = errno;
+        Close();
+        errno = err;
+        return -1;
+    }
+
+    BlockMapHeader header;
+    ssize_t res = pread_full(map_fd, (uint8_t*)&header, sizeof(header), 0);
+    if (res == 0) {
+        if (!writable) return 0;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, map_magic, sizeof(map_magic));
+        header.block_size = BLOCK_SIZE;
+        if (pwrite_full(map_fd, (uint8_t*)&header, sizeof(header), 0) != -1) return 0;
+    } else if (res == sizeof(header) && memcmp(header.magic, map_magic, sizeof(map_magic)) == 0 && header.block_size == BLOCK_SIZE) {
+        return 0;
+    } else if (res != -1) {
+        errno = EINVAL;
+    }
+
+    int err = errno;
+    Close();
+    errno = err;
+    return -1;
+}
+
+void BlockFile::Close()
+{
+    if (data_fd != -1) close(data_fd);
+    if (map_fd != -1) close(map_fd);
+    data_fd = map_fd = -1;
+}
+
+bool BlockFile::IsOpen() const
+{
+    return data_fd != -1;
+}
+
+int64_t BlockFile::Size()
+{
+    struct stat st;
+    if (fstat(data_fd, &st) == -1) return -1;
+    return st.st_size;
+}
+
+int BlockFile::ReadIVs(uint64_t first, size_t count, uint8_t* ivs)
+{
+    // 块表比文件短时，后面的块都是空洞
+    memset(ivs, 0, count * BLOCK_IV_SIZE);
+    if (map_fd == -1) return 0;
+    return pread_full(map_fd, ivs, count * BLOCK_IV_SIZE, map_offset(first)) == -1 ? -1 : 0;
+}
+
+ssize_t BlockFile::Read(uint8_t* buf, size_t size, uint64_t offset)
+{
+    int64_t file_size = Size();
+    if (file_size == -1) return -1;
+    if (offset >= (uint64_t)file_size || size == 0) return 0;
+    size = min((uint64_t)size, file_size - offset);
+
+    uint64_t first = offset / BLOCK_SIZE;
+    size_t count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+    vector<uint8_t> ivs(count * BLOCK_IV_SIZE);
+    if (ReadIVs(first, count, ivs.data()) == -1) return -1;
+
+    ssize_t res = pread_full(data_fd, buf, size, offset);
+    if (res == -1) return -1;
+    memset(buf+res, 0, size-res);
+
+    aes_parallel_for(count, size, [&](size_t i) {
+        uint64_t block_start = (first + i) * BLOCK_SIZE;
+        uint64_t begin = max(offset, block_start);
+        uint64_t end = min(offset + size, block_start + BLOCK_SIZE);
+        uint8_t* p = buf + (begin - offset);
+        const uint8_t* iv = ivs.data() + i * BLOCK_IV_SIZE;
+        if (is_hole(iv)) {
+            memset(p, 0, end - begin);
+        } else {
+            aes_ctr_xor(key, iv, begin - block_start, p, end - begin, p);
+        }
+    });
+
+    return size;
+}
+
+ssize_t BlockFile::Write(const uint8_t* buf, size_t size, uint64_t offset)
+{
+    if (size == 0) return 0;
+    int64_t file_size = Size();
+    if (file_size == -1) return -1;
+
+    // 原来的最后一块不完整，而这次写在后面的块中时，先把它补0到块尾
+    // 否则数据文件中这段是0，按原来的IV解密出来不是0
+    if (offset > (uint64_t)file_size && file_size % BLOCK_SIZE != 0 && offset / BLOCK_SIZE > (uint64_t)file_size / BLOCK_SIZE) {
+        uint64_t block_end = (file_size / BLOCK_SIZE + 1) * BLOCK_SIZE;
+        vector<uint8_t> zeros(block_end - file_size);
+        if (WriteBlocks(zeros.data(), zeros.size(), file_size, file_size) == -1) return -1;
+        file_size = block_end;
+    }
+
+    return WriteBlocks(buf, size, offset, file_size);
+}
+
+// 重新加密[offset, offset+size)所在的所有块，file_size为写入前的明文长度
+ssize_t BlockFile::WriteBlocks(const uint8_t* buf, size_t size, uint64_t offset, uint64_t file_size)
+{
+    uint64_t end = offset + size;
+    uint64_t new_size = max(file_size, end);
+    uint64_t first = offset / BLOCK_SIZE;
+    uint64_t last = (end - 1) / BLOCK_SIZE;
+
+    size_t batch = min((uint64_t)BLOCK_WRITE_BATCH, last - first + 1);
+    vector<uint8_t> plain(batch * BLOCK_SIZE);
+    vector<uint8_t> ivs(batch * BLOCK_IV_SIZE);
+
+    for(uint64_t batch_first = first; batch_first <= last; batch_first += batch) {
+        size_t count = min((uint64_t)batch, last - batch_first + 1);
+        uint64_t batch_start = batch_first * BLOCK_SIZE;
+        uint64_t batch_end = min(new_size, (batch_first + count) * BLOCK_SIZE);
+
+        for(size_t i = 0; i < count; i ++) {
+            uint64_t block_start = batch_start + i * BLOCK_SIZE;
+            uint64_t block_end = min(new_size, block_start + BLOCK_SIZE);
+            uint8_t* p = plain.data() + i * BLOCK_SIZE;
+
+            // 没有被完整覆盖的块(只可能是第一块和最后一块)需要原来的内容
+            if (offset > block_start || end < block_end) {
+                ssize_t res = Read(p, block_end - block_start, block_start);
+                if (res == -1) return -1;
+                memset(p+res, 0, block_end - block_start - res);
+            }
+            uint64_t begin = max(offset, block_start);
+            uint64_t stop = min(end, block_end);
+            memcpy(p + (begin - block_start), buf + (begin - offset), stop - begin);
+        }
+
+        RandomBytes(ivs.data(), count * BLOCK_IV_SIZE);
+        for(size_t i = 0; i < count; i ++) {
+            if (is_hole(ivs.data() + i * BLOCK_IV_SIZE)) ivs[i * BLOCK_IV_SIZE] = 1;
+        }
+
+        aes_parallel_for(count, batch_end - batch_start, [&](size_t i) {
+            uint64_t block_start = batch_start + i * BLOCK_SIZE;
+            uint64_t block_end = min(new_size, block_start + BLOCK_SIZE);
+            uint8_t* p = plain.data() + i * BLOCK_SIZE;
+            aes_ctr_xor(key, ivs.data() + i * BLOCK_IV_SIZE, 0, p, block_end - block_start, p);
+        });
+
+        // 先写数据再写IV
+        if (pwrite_full(data_fd, plain.data(), batch_end - batch_start, batch_start) == -1) return -1;
+        if (pwrite_full(map_fd, ivs.data(), count * BLOCK_IV_SIZE, map_offset(batch_first)) == -1) return -1;
+    }
+
+    return size;
+}
+
+int BlockFile::Truncate(uint64_t size)
+{
+    int64_t file_size = Size();
+    if (file_size == -1) return -1;
+
+    // 延长文件时和Write一样，先把原来不完整的最后一块补0
+    if (size > (uint64_t)file_size && file_size % BLOCK_SIZE != 0) {
+        uint64_t end = min(size, (uint64_t)(file_size / BLOCK_SIZE + 1) * BLOCK_SIZE);
+        vector<uint8_t> zeros(end - file_size);
+        if (WriteBlocks(zeros.data(), zeros.size(), file_size, file_size) == -1) return -1;
+    }
+
+    if (ftruncate(data_fd, size) == -1) return -1;
+    // 保证块表中超出文件末尾的项都是0，以后延长文件时新的块都是空洞
+    if (size < (uint64_t)file_size && map_fd != -1) {
+        if (ftruncate(map_fd, map_offset((size + BLOCK_SIZE - 1) / BLOCK_SIZE)) == -1) return -1;
+    }
+    return 0;
+}
+
+int BlockFile::Sync()
+{
+    if (data_fd != -1 && fsync(data_fd) == -1) return -1;
+    if (map_fd != -1 && fsync(map_fd) == -1) return -1;
+    return 0;
+}
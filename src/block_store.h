@@ -0,0 +1,51 @@
+#ifndef _BLOCK_STORE_H_
+#define _BLOCK_STORE_H_
+
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes.h"
+#include "aes_ctr.h"
+
+using namespace std;
+
+#define BLOCK_SIZE (64*1024)
+#define BLOCK_IV_SIZE AES_CTR_NONCE_SIZE
+#define BLOCK_WRITE_BATCH 16 // 一次加密并写入的块数
+
+// 分块加密的文件
+// 明文按BLOCK_SIZE分块，每块用自己的随机IV做CTR加密(计数器为 IV || 块内的16字节块序号)
+// 密文和明文一样长，存放在数据文件的相同位置，所以数据文件的大小就是明文的大小
+// 每块的IV依次存放在块表文件中，全0表示空洞，读出来全是0
+// 写入时整块换一个新的IV重新加密，同一个IV不会用来加密两份不同的内容
+// 出错时返回-1并设置errno
+class BlockFile
+{
+public:
+    BlockFile(const AesKey& key);
+    ~BlockFile();
+
+    // writable时数据文件和块表文件不存在则创建
+    // 只读时块表文件不存在视为全部是空洞
+    int Open(const string& data_path, const string& map_path, bool writable);
+    void Close();
+    bool IsOpen() const;
+
+    int64_t Size(); // 明文长度
+    ssize_t Read(uint8_t* buf, size_t size, uint64_t offset); // 返回读到的字节数，超出文件末尾的部分不读
+    ssize_t Write(const uint8_t* buf, size_t size, uint64_t offset); // 写在文件末尾之后时中间的部分是空洞
+    int Truncate(uint64_t size);
+    int Sync(); // fsync数据文件和块表文件
+
+private:
+    int ReadIVs(uint64_t first, size_t count, uint8_t* ivs);
+    ssize_t WriteBlocks(const uint8_t* buf, size_t size, uint64_t offset, uint64_t file_size);
+
+private:
+    const AesKey& key;
+    int data_fd;
+    int map_fd;
+};
+
+#endif // _BLOCK_STORE_H_
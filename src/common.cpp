@@ -1,25 +1,93 @@
 #include "common.h"
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
 
 using namespace std;
 
+#define BUFFER_MIN_SHIFT 9 // 缓冲池按2的幂分级，从512B
+#define BUFFER_MAX_SHIFT 20 // 到1MiB
+#define BUFFER_CLASS_BYTES (4*1024*1024) // 每一级空闲的缓冲最多占用的内存
+
+// 空闲缓冲的size()等于这一级的大小；Buffer改变size()时不写内存，取出和放回都不会初始化内容
+struct BufferClass
+{
+    mutex lock;
+    vector<Buffer*> free;
+};
+
+static BufferClass* buffer_classes()
+{
+    // 不析构：退出时其它线程可能还在释放缓冲
+    static BufferClass* classes = new BufferClass[BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1];
+    return classes;
+}
+
+static void ReleaseBuffer(Buffer* buffer)
+{
+    size_t capacity = buffer->capacity();
+    int shift = BUFFER_MIN_SHIFT;
+    while (shift < BUFFER_MAX_SHIFT && ((size_t)1 << (shift+1)) <= capacity) shift ++;
+    if (capacity < ((size_t)1 << BUFFER_MIN_SHIFT) || capacity >= ((size_t)1 << (BUFFER_MAX_SHIFT+1))) {
+        delete buffer;
+        return;
+    }
+
+    buffer->resize((size_t)1 << shift); // 不超过容量，不会重新分配，也不会清零
+    BufferClass& c = buffer_classes()[shift - BUFFER_MIN_SHIFT];
+    {
+        lock_guard<mutex> guard(c.lock);
+        if ((c.free.size() + 1) << shift <= BUFFER_CLASS_BYTES) {
+            c.free.push_back(buffer);
+            return;
+        }
+    }
+    delete buffer;
+}
+
 data_t CreateData()
 {
-    return data_t(new vector<uint8_t>());
+    return data_t(new Buffer(), ReleaseBuffer);
+}
+
+data_t CreateBuffer(size_t size)
+{
+    int shift = BUFFER_MIN_SHIFT;
+    while (shift <= BUFFER_MAX_SHIFT && ((size_t)1 << shift) < size) shift ++;
+    if (shift > BUFFER_MAX_SHIFT) {
+        data_t ret = CreateData();
+        ret->resize(size);
+        return ret;
+    }
+
+    Buffer* buffer = NULL;
+    {
+        BufferClass& c = buffer_classes()[shift - BUFFER_MIN_SHIFT];
+        lock_guard<mutex> guard(c.lock);
+        if (!c.free.empty()) {
+            buffer = c.free.back();
+            c.free.pop_back();
+        }
+    }
+    if (buffer == NULL) {
+        buffer = new Buffer();
+        buffer->reserve((size_t)1 << shift);
+    }
+    buffer->resize(size);
+    return data_t(buffer, ReleaseBuffer);
 }
 
 data_t CreateData(const string& data)
 {
-    data_t ret = CreateData();
-    ret->resize(data.length());
+    data_t ret = CreateBuffer(data.length());
     memcpy(ret->data(), data.c_str(), data.length());
     return ret;
 }
 
 data_t CreateData(void* data, size_t size)
 {
-    data_t ret = CreateData();
-    ret->resize(size);
+    data_t ret = CreateBuffer(size);
     memcpy(ret->data(), data, size);
     return ret;
 }
@@ -31,13 +99,25 @@ data_t Clone(data_t data)
 
 data_t Concat(data_t a, data_t b)
 {
-    data_t ret = CreateData();
-    ret->resize(a->size() + b->size());
+    data_t ret = CreateBuffer(a->size() + b->size());
     memcpy(ret->data(), a->data(), a->size());
     memcpy(ret->data()+a->size(), b->data(), b->size());
     return ret;
 }
 
+data_t Concat(const vector<Slice>& slices)
+{
+    size_t size = 0;
+    for(const Slice& slice : slices) size += slice.size;
+    data_t ret = CreateBuffer(size);
+    size_t pos = 0;
+    for(const Slice& slice : slices) {
+        memcpy(ret->data()+pos, slice.data(), slice.size);
+        pos += slice.size;
+    }
+    return ret;
+}
+
 SecretKey string2secret(string secret_key)
 {
     SecretKey ans;
@@ -50,3 +130,12 @@ SecretKey string2secret(string secret_key)
 
     return ans;
 }
+
+void RandomBytes(void* buf, size_t size)
+{
+    static FILE* urandom = fopen("/dev/urandom", "rb");
+    if (urandom == NULL || fread(buf, 1, size, urandom) != size) {
+        perror("RandomBytes: /dev/urandom");
+        exit(1);
+    }
+}
@@ -8,14 +8,46 @@
 
 using namespace std;
 
-typedef shared_ptr<vector<uint8_t> > data_t; // 用来储存数据
+// resize()变大时新的部分不初始化的allocator，缓冲池取出和放回缓冲时都不需要写内存
+template<class T>
+struct UninitializedAllocator : allocator<T>
+{
+    template<class U> struct rebind { typedef UninitializedAllocator<U> other; };
+
+    UninitializedAllocator() noexcept {}
+    template<class U> UninitializedAllocator(const UninitializedAllocator<U>&) noexcept {}
+
+    template<class U> void construct(U* p) { ::new((void*)p) U; }
+    template<class U, class... Args> void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+};
+
+typedef vector<uint8_t, UninitializedAllocator<uint8_t> > Buffer; // resize()变大时新的部分是未初始化的，需要0时自己填
+typedef shared_ptr<Buffer> data_t; // 用来储存数据
 
+// 所有data_t释放时把缓冲按容量放回缓冲池，不超过1MiB的缓冲可以重复使用
 data_t CreateData();
+data_t CreateBuffer(size_t size); // 从缓冲池中取出size字节，内容未初始化，调用者需要全部写入
 data_t CreateData(const string& data);
 data_t CreateData(void* data, size_t size);
 data_t Clone(data_t data);
 data_t Concat(data_t a, data_t b);
 
+// data_t中的一段，不复制数据，owner保证这段内存有效
+// 持有分片期间owner的内容不能再被修改，需要修改的一方先复制一份
+struct Slice
+{
+    data_t owner;
+    size_t offset;
+    size_t size;
+
+    Slice() : offset(0), size(0) {}
+    Slice(data_t owner) : owner(owner), offset(0), size(owner->size()) {}
+    Slice(data_t owner, size_t offset, size_t size) : owner(owner), offset(offset), size(size) {}
+    const uint8_t* data() const { return owner->data() + offset; }
+};
+
+data_t Concat(const vector<Slice>& slices); // 把各段复制到一个连续的缓冲中
+
 // 密钥
 struct SecretKey
 {
@@ -24,4 +56,6 @@ struct SecretKey
 
 SecretKey string2secret(string secret_key);
 
+void RandomBytes(void* buf, size_t size); // 从/dev/urandom读取随机数
+
 #endif // _COMMON_H_
@@ -1,5 +1,7 @@
 #include "file_control.h"
 #include "aes.h"
+#include "aes_parallel.h"
+#include "options.h"
 #include <plog/Log.h>
 #include <cassert>
 #include <ctime>
@@ -12,10 +14,42 @@ using namespace std;
 
 #define ASSERT(expr) { if (!(expr)) { LOG_ERROR << #expr; exit(1); } }
 
+// cfg文件以CfgHeader开头，之后是若干条File记录
+// 旧版本的cfg没有文件头，直接是若干条LegacyFile记录，其中的文件都是ECB格式
+// 旧记录以文件名开头，文件名总是以'/'开头，不会和magic混淆
+static const char cfg_magic[8] = {'S', 'D', 'C', 'F', 'G', '\0', '\0', '\2'};
+
+struct CfgHeader
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+// 日志超过这个大小并且比快照大时压缩
+#define JOURNAL_COMPACT_SIZE (4*1024*1024)
+
+struct LegacyFile
+{
+    char filename[FILENAME_MAX_SIZE];
+    time_t timestamp;
+    bool is_deleted;
+    uint32_t extra_length;
+    uint8_t extra_data[16];
+};
+
 FileControl::FileControl(string pd_path, vector<string> keystrings)
+    : journal(PathJoin(pd_path, "cfg.journal"), sizeof(File)),
+      policy((size_t)options.cache_size * (1024*1024 / BLOCK_SIZE)),
+      readahead_pool(READAHEAD_WORKERS)
 {
     this->pd_path = pd_path;
     this->cfg_filename = PathJoin(pd_path, "cfg");
+    this->pd_fd = open(pd_path.c_str(), O_RDONLY|O_DIRECTORY);
+    memset(&stats, 0, sizeof(stats));
+    received_unsynced = false;
+    stopping = false;
+    stats.budget_bytes = (uint64_t)options.cache_size * 1024*1024;
 
     for(int i = 0; i < (int)keystrings.size(); i ++) {
         KeyEntry entry;
@@ -30,21 +64,29 @@ FileControl::FileControl(string pd_path, vector<string> keystrings)
         entry.name = keystrings[i].substr(0, pos);
         entry.keystring = keystrings[i].substr(pos+1);
         entry.key = string2secret(entry.keystring);
+        aes_expand_key((uint8_t*)&entry.key, sizeof(entry.key), &entry.aes);
 
         LOG_INFO << entry.name << " " << entry.keystring;
 
         keys.push_back(entry);
     }
 
-    vector<SecretKey> secrets;
+    vector<AesKey> secrets;
     for(int i = 0; i < (int)keys.size(); i ++) {
-        secrets.push_back(keys[i].key);
+        secrets.push_back(keys[i].aes);
     }
-    net = new Networking(secrets);
+    net = new Networking(secrets, options.wire_version, options.wire_accept_v1 != 0);
 }
 
 FileControl::~FileControl()
 {
+    {
+        lock_guard<mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    if (sync_thread.joinable()) sync_thread.join();
+    if (pd_fd != -1) close(pd_fd);
     delete net;
 }
 
@@ -73,13 +115,27 @@ void FileControl::Init()
         if (dirs.find(keys[i].name) == dirs.end()) {
             mkdir(Resolve(keys[i].name).c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
         }
+    if (dirs.find(".blockmap") == dirs.end()) {
+        mkdir(Resolve(".blockmap").c_str(), S_IRWXU);
+    }
     
     LoadCFG();
+    RecoverMigrations();
     
     net->Listen();
     StartThread();
 }
 
+void FileControl::SetChangeHandler(function<void(const char*)> handler)
+{
+    change_handler = handler;
+}
+
+void FileControl::SetSender(function<void(const data_t&)> sender)
+{
+    net->SetSender(sender);
+}
+
 string FileControl::Resolve(const string& path) const
 {
     return PathJoin(pd_path, path);
@@ -126,173 +182,878 @@ vector<string> FileControl::KeyNames() const
 
 File* FileControl::FindFile(const char *path)
 {
-    for(int i = 0; i < (int)files.size(); i ++)
-    {
-        if (strcmp(path, files[i].filename) == 0)
-        {
-            return &files[i];
-        }
-    }
+    shared_lock<shared_timed_mutex> guard(files_mutex);
+    auto it = file_index.find(path);
+    return it == file_index.end() ? NULL : it->second;
+}
 
-    return NULL;
+File* FileControl::AddFile(const char *path)
+{
+    File file;
+    memset(&file, 0, sizeof(file));
+    strncpy(file.filename, path, FILENAME_MAX_SIZE-1);
+    file.format = FILE_FORMAT_BLOCK;
+    RandomBytes(file.nonce, sizeof(file.nonce));
+
+    lock_guard<shared_timed_mutex> guard(files_mutex);
+    auto it = file_index.find(file.filename);
+    if (it != file_index.end()) return it->second;
+    return InsertFile(file);
 }
 
-void FileControl::Sync(const char *path)
+shared_timed_mutex& FileControl::FileLock(const char* path)
 {
-    sync_mutex.lock();
-    bool flag = false;
-    if (file_cache.find(path) != file_cache.end())
-    {
-        LOG_INFO << "Sync: " << path;
-        if (is_dirty.at(path)) {
-            time_t timepoint1 = time(NULL);
+    return FileLock(PathHash()(path));
+}
 
-            int fd = open(Resolve(path).c_str(), O_WRONLY|O_CREAT, 0666);
-            SaveFile(path, fd, file_cache.at(path));
-            close(fd);
-            is_dirty[path] = false;
-            flag = true;
+shared_timed_mutex& FileControl::FileLock(size_t hash)
+{
+    return file_locks[hash % FILE_LOCK_STRIPES];
+}
 
-            LOG_INFO << "Sync Time1: " << path << " " << time(NULL)-timepoint1;
-        }
-        LOG_INFO << "Sync End: " << path;
+shared_timed_mutex& FileControl::FileLock(const char* path, const FileRef* ref)
+{
+    return ref != NULL ? FileLock(ref->hash) : FileLock(path);
+}
+
+File* FileControl::InsertFile(const File& file)
+{
+    files.push_back(file);
+    File* x = &files.back();
+    x->filename[FILENAME_MAX_SIZE-1] = '\0';
+    if (file_index.insert(make_pair((const char*)x->filename, x)).second) {
+        file_paths.insert(x->filename);
     }
-    sync_mutex.unlock();
-    
-    if (flag) {
+    return x;
+}
+
+int FileControl::Stat(const char *path, struct stat *st, const FileRef* ref)
+{
+    if (lstat(ref != NULL ? ref->real : Resolve(path).c_str(), st) == -1) return -1;
+    File* x = ref != NULL ? ref->file : NULL;
+    if (x == NULL) x = FindFile(path);
+    if (x == NULL) return 0;
+    {
+        shared_lock<shared_timed_mutex> record_lock(FileLock(path, ref));
+        st->st_mtime = x->timestamp;
+    }
+
+    // 不在缓存中时磁盘上的长度就是明文长度
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry = OpenEntry(path, x, ref != NULL ? ref->handle : NULL, lock, false);
+    if (entry != nullptr && S_ISREG(st->st_mode)) st->st_size = entry->size;
+    return 0;
+}
+
+void FileControl::Sync(const char *path)
+{
+    if (FlushFile(path) > 0) {
         time_t timepoint2 = time(NULL);
         BroadcastFile(path);
         LOG_INFO << "Sync Time2: " << path << " " << time(NULL)-timepoint2;
     }
 }
 
+int FileControl::FlushFile(const char *path, bool durable)
+{
+    // 写回时读文件记录中的format和nonce
+    shared_lock<shared_timed_mutex> record_lock(FileLock(path));
+    return FlushLocked(path, durable);
+}
+
+int FileControl::FlushLocked(const char *path, bool durable)
+{
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry = OpenEntry(path, lock, false);
+    if (entry == nullptr) return 0;
+
+    LOG_INFO << "Sync: " << path;
+    WaitReady(*entry, lock);
+    int flag = 0;
+    if (!entry->dirty.empty() || entry->resized) {
+        time_t timepoint1 = time(NULL);
+        flag = Flush(path, *entry, lock, durable) == -1 ? -1 : 1;
+        LOG_INFO << "Sync Time1: " << path << " " << time(NULL)-timepoint1;
+    }
+    if (flag == 0 && entry->unsent) flag = 1;
+    if (flag == 1) entry->unsent = false;
+    lock.unlock();
+    entry.reset();
+    RemoveEntry(path, true); // 所有的块都已经被淘汰
+    LOG_INFO << "Sync End: " << path;
+    return flag;
+}
+
 void FileControl::SyncDir(const char *path)
 {
-    sync_mutex.lock();
     LOG_INFO << "SyncDir: " << path;
-    vector<string> files;
-    for(const auto& it : file_cache)
-    {
-        if (it.first.length() >= strlen(path) && strncmp(it.first.c_str(), path, strlen(path)) == 0)
+    SyncFiles(CachedWithPrefix(path));
+}
+
+void FileControl::SyncFiles(const vector<string>& paths)
+{
+    if (options.durability == DURABILITY_STRICT) {
+        for(const auto& name: paths) Sync(name.c_str());
+        return;
+    }
+
+    // 先把所有文件写回，只在最后做一次写盘，广播前数据已经在磁盘上
+    vector<string> flushed;
+    for(const auto& name: paths) {
+        if (FlushFile(name.c_str(), false) > 0) flushed.push_back(name);
+    }
+    // 接收线程直接写入磁盘的修改也由这次syncfs保证，它们不需要广播
+    bool received = received_unsynced.exchange(false);
+    if (flushed.empty() && !received) return;
+    time_t timepoint = time(NULL);
+    if (SyncAll() == -1) LOG_ERROR << "syncfs : " << strerror(errno);
+    LOG_INFO << "SyncFiles: " << flushed.size() << " files " << time(NULL)-timepoint;
+    for(const auto& name: flushed) {
+        BroadcastFile(name.c_str());
+    }
+}
+
+int FileControl::SyncAll()
+{
+    if (pd_fd == -1) {
+        sync();
+        return 0;
+    }
+    return syncfs(pd_fd);
+}
+
+void FileControl::ClearCache(const char *path)
+{
+    LOG_INFO << "ClearCache: " << path;
+    RemoveEntry(path, false);
+    LOG_INFO << "ClearCache End: " << path;
+}
+
+CacheStats FileControl::Stats()
+{
+    uint64_t cached_bytes = 0;
+    for(const auto& it : Entries()) {
+        lock_guard<mutex> guard(it.second->lock);
+        for(const auto& block : it.second->blocks) cached_bytes += block.second->size();
+    }
+    lock_guard<mutex> guard(policy_mutex);
+    CacheStats ret = stats;
+    ret.cached_bytes = cached_bytes;
+    return ret;
+}
+
+static vector<string> paths_with_prefix(const PathSet& paths, const char *prefix)
+{
+    vector<string> ret;
+    size_t length = strlen(prefix);
+    for(auto it = paths.lower_bound(prefix); it != paths.end() && strncmp(*it, prefix, length) == 0; ++ it) {
+        ret.push_back(*it);
+    }
+    return ret;
+}
+
+vector<string> FileControl::CachedWithPrefix(const char *prefix)
+{
+    lock_guard<mutex> guard(cache_paths_mutex);
+    return paths_with_prefix(cache_paths, prefix);
+}
+
+vector<string> FileControl::FilesWithPrefix(const char *prefix)
+{
+    shared_lock<shared_timed_mutex> guard(files_mutex);
+    return paths_with_prefix(file_paths, prefix);
+}
+
+CacheShard& FileControl::Shard(const char* path)
+{
+    return shards[PathHash()(path) % CACHE_SHARDS];
+}
+
+vector<pair<string, shared_ptr<CacheEntry>>> FileControl::Entries()
+{
+    vector<pair<string, shared_ptr<CacheEntry>>> ret;
+    for(auto& shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+        ret.insert(ret.end(), shard.entries.begin(), shard.entries.end());
+    }
+    return ret;
+}
+
+void FileControl::RemoveEntry(const string& path, bool empty_only)
+{
+    CacheShard& shard = Shard(path.c_str());
+    while (true) {
+        unique_lock<mutex> shard_lock(shard.lock);
+        auto it = shard.entries.find(path);
+        if (it == shard.entries.end()) return;
+        shared_ptr<CacheEntry> entry = it->second;
+        unique_lock<mutex> lock(entry->lock);
+
+        // 分组和这里各持有一个引用，更多的引用说明还有请求在使用，不能删除，否则它的修改会丢失
+        // 从FileHandle拿到的引用可能在这之后才增加，它们锁住项之后会看到removed，重新查找
+        bool used = entry.use_count() > 2;
+        if (entry->state == CACHE_READY && !used) {
+            if (empty_only && (!entry->blocks.empty() || !entry->dirty.empty() || entry->resized || entry->unsent)) return;
+            ASSERT(entry->dirty.empty() && !entry->resized);
+            {
+                lock_guard<mutex> guard(policy_mutex);
+                for(const auto& block : entry->blocks) policy.Erase(BlockKey(path, block.first));
+                for(uint64_t block : entry->prefetched) stats.readahead_wasted += entry->blocks.at(block)->size();
+            }
+            entry->removed = true;
+            entry->cv.notify_all();
+            {
+                lock_guard<mutex> guard(cache_paths_mutex);
+                cache_paths.erase(it->first.c_str());
+            }
+            shard.entries.erase(it);
+            return;
+        }
+        if (empty_only) return;
+        // 等待时不能持有分组的锁，否则打开失败的请求无法把项删除
+        shard_lock.unlock();
+        if (used) {
+            lock.unlock();
+            entry.reset();
+            this_thread::yield();
+        } else {
+            entry->cv.wait(lock, [&]() { return entry->state == CACHE_READY; });
+        }
+    }
+}
+
+void FileControl::Trim()
+{
+    BlockKey key;
+    while (true) {
         {
-            files.push_back(it.first);
+            lock_guard<mutex> guard(policy_mutex);
+            if (!policy.Evict(key)) break;
+        }
+        unique_lock<mutex> lock;
+        shared_ptr<CacheEntry> entry = OpenEntry(key.first.c_str(), lock, false);
+        if (entry == nullptr || entry->blocks.find(key.second) == entry->blocks.end()) continue;
+        if (entry->state != CACHE_READY) { // 正在写回，这次先不淘汰
+            lock_guard<mutex> guard(policy_mutex);
+            policy.Restore(key);
+            break;
         }
+
+        bool flushed = false;
+        shared_lock<shared_timed_mutex> record_lock(FileLock(key.first.c_str()), defer_lock);
+        if (entry->dirty.find(key.second) != entry->dirty.end()) { // 先写回整个文件的脏块，广播留给sync_thread
+            // 写回要读这个文件的记录，拿不到记录锁(正在被删除、移走或者接收修改)时先不淘汰
+            if (!record_lock.try_lock()) {
+                lock_guard<mutex> guard(policy_mutex);
+                policy.Restore(key);
+                break;
+            }
+            LOG_INFO << "Trim: flush " << key.first;
+            if (Flush(key.first.c_str(), *entry, lock, options.durability == DURABILITY_STRICT) == -1) {
+                lock_guard<mutex> guard(policy_mutex);
+                policy.Restore(key); // 写回失败时保留，等下次同步
+                break;
+            }
+            entry->unsent = true;
+            flushed = true;
+        }
+        uint64_t wasted = entry->prefetched.erase(key.second) ? entry->blocks.at(key.second)->size() : 0;
+        entry->blocks.erase(key.second);
+        bool empty = entry->blocks.empty();
+        lock.unlock();
+        entry.reset();
+        if (record_lock.owns_lock()) record_lock.unlock();
+
+        {
+            lock_guard<mutex> guard(policy_mutex);
+            if (flushed) stats.dirty_evictions ++;
+            stats.evictions ++;
+            stats.readahead_wasted += wasted;
+        }
+        if (empty) RemoveEntry(key.first, true);
     }
-    sync_mutex.unlock();
-    for(const auto& name: files)
-    {
-        Sync(name.c_str());
+}
+
+void FileControl::Touch(const char *path, uint64_t first, uint64_t last, set<uint64_t>* prefetched)
+{
+    static thread_local BlockKey key; // 每个线程一个，复制文件名时重用上次的空间，在锁外面
+    key.first.assign(path);
+    lock_guard<mutex> guard(policy_mutex);
+    for(uint64_t block = first; block <= last; block ++) {
+        // 否则预读的块第一次被读就进入T2，顺序扫描会把常用的块挤出去
+        if (prefetched != NULL && prefetched->erase(block)) {
+            stats.hits ++;
+            stats.readahead_hits ++;
+            continue;
+        }
+        key.second = block;
+        if (policy.Access(key)) stats.hits ++;
+        else stats.misses ++;
     }
 }
 
-void FileControl::ClearCache(const char *path)
+// 第i块的长度，只有最后一块可能不满
+static size_t block_length(uint64_t size, uint64_t block)
+{
+    uint64_t start = block * BLOCK_SIZE;
+    return start >= size ? 0 : min((uint64_t)BLOCK_SIZE, size - start);
+}
+
+// 缓存的块可能正被广播中的分片引用，修改之前换成自己的一份
+static void Unshare(data_t& data)
 {
-    sync_mutex.lock();
-    if (file_cache.find(path) != file_cache.end())
+    if (data.use_count() > 1) data = Clone(data);
+}
+
+shared_ptr<CacheEntry> FileControl::OpenEntry(const char *path, unique_lock<mutex>& lock, bool create, File* x)
+{
+    CacheShard& shard = Shard(path);
+    while (true) {
+        unique_lock<mutex> shard_lock(shard.lock);
+        auto it = shard.entries.find(path);
+        if (it != shard.entries.end()) {
+            shared_ptr<CacheEntry> entry = it->second;
+            shard_lock.unlock();
+            lock = unique_lock<mutex>(entry->lock);
+            entry->cv.wait(lock, [&]() { return entry->state != CACHE_LOADING; });
+            if (!entry->removed) return entry;
+            lock.unlock(); // 打开失败或者已经被删除，重新查找
+            continue;
+        }
+        if (!create) return nullptr;
+
+        shared_ptr<CacheEntry> entry = make_shared<CacheEntry>();
+        entry->state = CACHE_LOADING;
+        entry->removed = false;
+        it = shard.entries.insert(make_pair(string(path), entry)).first;
+        {
+            lock_guard<mutex> guard(cache_paths_mutex);
+            cache_paths.insert(it->first.c_str());
+        }
+        shard_lock.unlock();
+
+        // 读文件长度时不持有任何锁，同一个文件的其它请求在entry->cv上等待
+        LOG_INFO << "OpenEntry: " << path;
+        // 调用者持有这个文件的记录锁，format可以直接读；旧格式的文件调用者已经用Migrate转换过
+        if (x == NULL) x = FindFile(path);
+        bool ok = x != NULL && x->format == FILE_FORMAT_BLOCK; // 已经被删除或者移走的文件没有记录，不建立缓存项
+        if (!ok) {
+            shard_lock.lock();
+            it = shard.entries.find(path);
+            if (it != shard.entries.end() && it->second == entry) {
+                lock_guard<mutex> guard(cache_paths_mutex);
+                cache_paths.erase(it->first.c_str());
+                shard.entries.erase(it);
+            }
+            shard_lock.unlock();
+        }
+
+        lock = unique_lock<mutex>(entry->lock);
+        entry->key_index = ok ? KeyIndex(path) : -1;
+        entry->size = entry->stored_size = FileSize(Resolve(path));
+        entry->resized = false;
+        entry->unsent = false;
+        entry->last_modify = time(NULL);
+        entry->state = CACHE_READY;
+        entry->removed = !ok;
+        entry->cv.notify_all();
+        if (ok) return entry;
+        lock.unlock();
+        return nullptr;
+    }
+}
+
+shared_ptr<CacheEntry> FileControl::OpenEntry(const char *path, File* x, FileHandle* handle, unique_lock<mutex>& lock, bool create)
+{
+    if (handle == NULL) return OpenEntry(path, lock, create, x);
+
+    shared_ptr<CacheEntry> entry;
     {
-        LOG_INFO << "ClearCache: " << path;
-        ASSERT(is_dirty.at(path) == false);
-        file_cache.erase(file_cache.find(path));
-        last_hit.erase(last_hit.find(path));
-        is_dirty.erase(is_dirty.find(path));
-        last_modify.erase(last_modify.find(path));
-        LOG_INFO << "ClearCache End: " << path;
+        lock_guard<mutex> guard(handle->lock);
+        if (handle->file == x) entry = handle->entry.lock();
+    }
+    // 不经过分组拿到的引用，RemoveEntry可能没有算上它，所以和OpenEntry一样锁住之后检查removed
+    if (entry != nullptr) {
+        lock = unique_lock<mutex>(entry->lock);
+        entry->cv.wait(lock, [&]() { return entry->state != CACHE_LOADING; });
+        if (!entry->removed) return entry;
+        lock.unlock();
     }
-    sync_mutex.unlock();
+
+    entry = OpenEntry(path, lock, create, x);
+    if (entry != nullptr) {
+        lock_guard<mutex> guard(handle->lock);
+        handle->file = x;
+        handle->entry = entry;
+    }
+    return entry;
 }
 
-data_t FileControl::Touch(const char *path, bool readonly)
+void FileControl::WaitReady(CacheEntry& entry, unique_lock<mutex>& lock)
 {
-    sync_mutex.lock();
-    LOG_INFO << "Touch: " << path;
-    
-    if (file_cache.find(path) == file_cache.end())
+    entry.cv.wait(lock, [&]() { return entry.state == CACHE_READY; });
+}
+
+int FileControl::LoadBlocks(const char *path, CacheEntry& entry, uint64_t first, uint64_t last)
+{
+    BlockFile blocks(keys[entry.key_index].aes);
+    bool opened = false;
+
+    for(uint64_t block = first; block <= last; block ++) {
+        if (entry.blocks.find(block) != entry.blocks.end()) continue;
+
+        data_t data = CreateBuffer(block_length(entry.size, block));
+        // stored_size之后的部分还没有写入磁盘，或者已经被截掉了，都是0
+        uint64_t start = block * BLOCK_SIZE;
+        ssize_t res = 0;
+        if (start < entry.stored_size) {
+            if (!opened && OpenBlocks(path, blocks, false) == -1) return -1;
+            opened = true;
+            size_t size = min((uint64_t)data->size(), entry.stored_size - start);
+            res = blocks.Read(data->data(), size, start);
+            if (res == -1) {
+                LOG_ERROR << "read blocks : " << strerror(errno);
+                return -1;
+            }
+        }
+        memset(data->data() + res, 0, data->size() - res);
+        entry.blocks[block] = data;
+    }
+    return 0;
+}
+
+void FileControl::ResizeEntry(const char *path, CacheEntry& entry, uint64_t size)
+{
+    if (size == entry.size) return;
+    uint64_t old_size = entry.size;
+    entry.size = size;
+    entry.stored_size = min(entry.stored_size, size);
+    entry.resized = true;
+
+    auto it = entry.blocks.lower_bound((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (it != entry.blocks.end()) {
+        entry.dirty.erase(it->first);
+        {
+            lock_guard<mutex> guard(policy_mutex);
+            policy.Erase(BlockKey(path, it->first));
+            if (entry.prefetched.erase(it->first)) stats.readahead_wasted += it->second->size();
+        }
+        it = entry.blocks.erase(it);
+    }
+    // 其它块的长度不变，只有原来和现在的最后一块需要截短或者补0
+    for(uint64_t block : {old_size / BLOCK_SIZE, size / BLOCK_SIZE}) {
+        auto it = entry.blocks.find(block);
+        if (it != entry.blocks.end()) {
+            Unshare(it->second);
+            size_t length = it->second->size();
+            it->second->resize(block_length(size, block));
+            if (it->second->size() > length) memset(it->second->data() + length, 0, it->second->size() - length);
+        }
+    }
+}
+
+bool FileControl::WaitBlocks(CacheEntry& entry, unique_lock<mutex>& lock, uint64_t first, uint64_t last)
+{
+    while (true) {
+        if (entry.state == CACHE_READY) return true;
+
+        // 写回期间只能读已经缓存的块，否则等写回完成
+        bool cached = true;
+        for(uint64_t block = first; block <= last && cached; block ++) {
+            cached = entry.blocks.find(block) != entry.blocks.end();
+        }
+        if (cached) return false;
+        entry.cv.wait(lock);
+    }
+}
+
+int FileControl::ReadCached(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, uint8_t *buf, size_t size, uint64_t offset)
+{
+    uint64_t end, first, last;
+    while (true) {
+        if (offset >= entry.size || size == 0) return 0;
+        end = min(offset + size, entry.size);
+        first = offset / BLOCK_SIZE;
+        last = (end - 1) / BLOCK_SIZE;
+        if (entry.state == CACHE_READY || !WaitBlocks(entry, lock, first, last)) break;
+    }
+    if (LoadBlocks(path, entry, first, last) == -1) return -1;
+
+    for(uint64_t block = first; block <= last; block ++) {
+        uint64_t start = block * BLOCK_SIZE;
+        uint64_t begin = max(offset, start);
+        uint64_t stop = min(end, start + BLOCK_SIZE);
+        memcpy(buf + (begin - offset), entry.blocks.at(block)->data() + (begin - start), stop - begin);
+    }
+    Touch(path, first, last, &entry.prefetched);
+    return end - offset;
+}
+
+int FileControl::ReadSlices(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, size_t size, uint64_t offset, vector<Slice>& out)
+{
+    uint64_t end, first, last;
+    while (true) {
+        if (offset >= entry.size || size == 0) return 0;
+        end = min(offset + size, entry.size);
+        first = offset / BLOCK_SIZE;
+        last = (end - 1) / BLOCK_SIZE;
+        if (entry.state == CACHE_READY || !WaitBlocks(entry, lock, first, last)) break;
+    }
+
+    BlockFile blocks(keys[entry.key_index].aes);
+    for(uint64_t block = first; block <= last; block ++) {
+        uint64_t start = block * BLOCK_SIZE;
+        uint64_t begin = max(offset, start);
+        uint64_t stop = min(end, start + BLOCK_SIZE);
+        auto it = entry.blocks.find(block);
+        if (it != entry.blocks.end()) { // 引用缓存中的块，之后修改这一块时会先复制
+            out.push_back(Slice(it->second, begin - start, stop - begin));
+            continue;
+        }
+
+        // 不放进缓存的块直接从磁盘读，和LoadBlocks一样stored_size之后是0
+        data_t data = CreateBuffer(stop - begin);
+        memset(data->data(), 0, data->size());
+        if (begin < entry.stored_size) {
+            if (!blocks.IsOpen() && OpenBlocks(path, blocks, false) == -1) return -1;
+            if (blocks.Read(data->data(), min(stop, entry.stored_size) - begin, begin) == -1) {
+                LOG_ERROR << "read blocks : " << strerror(errno);
+                return -1;
+            }
+        }
+        out.push_back(Slice(data));
+    }
+    return end - offset;
+}
+
+int FileControl::WriteCached(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, const uint8_t *buf, size_t size, uint64_t offset)
+{
+    if (size == 0) return 0;
+    WaitReady(entry, lock);
+    uint64_t end = offset + size;
+    if (end > entry.size) ResizeEntry(path, entry, end);
+
+    for(uint64_t block = offset / BLOCK_SIZE; block * BLOCK_SIZE < end; block ++) {
+        uint64_t start = block * BLOCK_SIZE;
+        uint64_t begin = max(offset, start);
+        uint64_t stop = min(end, start + BLOCK_SIZE);
+        // 整块都被覆盖时不需要读出原来的内容
+        if (entry.blocks.find(block) == entry.blocks.end()) {
+            if (begin > start || stop < start + block_length(entry.size, block)) {
+                if (LoadBlocks(path, entry, block, block) == -1) return -1;
+            } else {
+                entry.blocks[block] = CreateBuffer(stop - start);
+            }
+        }
+        data_t& data = entry.blocks.at(block);
+        Unshare(data);
+        memcpy(data->data() + (begin - start), buf + (begin - offset), stop - begin);
+        entry.dirty.insert(block);
+        entry.prefetched.erase(block); // 被覆盖之前没有读过，也不算浪费
+    }
+    Touch(path, offset / BLOCK_SIZE, (end - 1) / BLOCK_SIZE);
+    entry.last_modify = time(NULL);
+    return size;
+}
+
+int FileControl::Flush(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, bool durable)
+{
+    // 写回期间修改、截断、淘汰和从磁盘载入都会等待，脏块的内容和文件长度不会变，可以在锁外面加密和写入
+    entry.state = CACHE_FLUSHING;
+    uint64_t size = entry.size, stored_size = entry.stored_size;
+    vector<pair<uint64_t, data_t>> dirty;
+    for(uint64_t block : entry.dirty) dirty.push_back(make_pair(block, entry.blocks.at(block)));
+    lock.unlock();
+
+    BlockFile blocks(keys[entry.key_index].aes);
+    int res = OpenBlocks(path, blocks, true);
+
+    // 截掉的部分不能留在磁盘上，否则之后延长文件时会被当成文件的内容
+    if (res != -1 && (uint64_t)blocks.Size() > stored_size) res = blocks.Truncate(stored_size);
+
+    // 连续的脏块合并起来写入，每次最多BLOCK_WRITE_BATCH块
+    vector<uint8_t> run;
+    uint64_t flush_bytes = 0;
+    size_t i = 0;
+    while (res != -1 && i < dirty.size()) {
+        uint64_t first = dirty[i].first;
+        run.clear();
+        for(uint64_t block = first; i < dirty.size() && dirty[i].first == block && block - first < BLOCK_WRITE_BATCH; ++ i, ++ block) {
+            const data_t& data = dirty[i].second;
+            run.insert(run.end(), data->begin(), data->end());
+        }
+        if (blocks.Write(run.data(), run.size(), first * BLOCK_SIZE) == -1) res = -1;
+        flush_bytes += run.size();
+    }
+
+    if (res != -1 && (uint64_t)blocks.Size() != size) res = blocks.Truncate(size);
+    if (res != -1 && durable) res = blocks.Sync();
+    if (res == -1) LOG_ERROR << "flush : " << path << " " << strerror(errno);
+
+    lock.lock();
+    entry.state = CACHE_READY;
+    entry.cv.notify_all();
     {
-        file_cache[path] = LoadFile(path);
-        last_modify[path] = 0;
-        is_dirty[path] = false;
+        lock_guard<mutex> guard(policy_mutex);
+        stats.flush_bytes += flush_bytes;
+        if (res != -1) stats.flushes ++;
     }
-    last_hit[path] = time(NULL);
-    is_dirty[path] |= !readonly;
+    if (res == -1) return res;
 
-    LOG_INFO << "Touch End: " << path;
-    sync_mutex.unlock();
-    return file_cache.at(path);
+    entry.dirty.clear();
+    entry.resized = false;
+    entry.stored_size = entry.size;
+    return res;
+}
+
+void FileControl::DropBlocks(const char *path, CacheEntry& entry, uint64_t first, uint64_t last)
+{
+    auto it = entry.blocks.lower_bound(first);
+    while (it != entry.blocks.end() && it->first <= last) {
+        ASSERT(entry.dirty.find(it->first) == entry.dirty.end());
+        {
+            lock_guard<mutex> guard(policy_mutex);
+            policy.Erase(BlockKey(path, it->first));
+            if (entry.prefetched.erase(it->first)) stats.readahead_wasted += it->second->size();
+        }
+        it = entry.blocks.erase(it);
+    }
+}
+
+void FileControl::EndDirectWrite(const char *path, CacheEntry& entry, bool ok, uint64_t size)
+{
+    entry.state = CACHE_READY;
+    entry.cv.notify_all();
+    if (ok) { // 没有被覆盖的块仍然和磁盘一致，只需要调整长度
+        ResizeEntry(path, entry, size);
+        entry.stored_size = size;
+        entry.resized = false;
+    } else { // 不知道磁盘上改了多少，缓存的块都不再可信
+        DropBlocks(path, entry, 0, UINT64_MAX);
+        entry.size = entry.stored_size = FileSize(Resolve(path));
+    }
+}
+
+void FileControl::ScheduleReadahead(const char *path, CacheEntry& entry, int fd, uint64_t offset, size_t size)
+{
+    // 窗口不超过缓存预算的1/4，否则预读的块还没被读到就被淘汰了
+    uint64_t max_window = min((uint64_t)options.readahead * 1024, (uint64_t)options.cache_size * 1024*1024 / 4);
+    if (max_window == 0 || size == 0) return;
+    ReadStream& stream = entry.streams[fd];
+    uint64_t end = offset + size;
+    if (offset != stream.next) { // 随机读，重新开始
+        stream.next = end;
+        stream.window = 0;
+        stream.ahead = 0;
+        return;
+    }
+    stream.next = end;
+    stream.window = stream.window == 0 ? min(max_window, (uint64_t)READAHEAD_MIN_WINDOW) : min(max_window, stream.window * 2);
+
+    // 已经预读的部分剩下不到半个窗口时，再预读到当前位置之后一个窗口
+    uint64_t first = max(stream.ahead, (end + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    uint64_t stop = min(end + stream.window, entry.size);
+    if (stop <= first * BLOCK_SIZE || first * BLOCK_SIZE - end >= stream.window / 2) return;
+    uint64_t last = (stop - 1) / BLOCK_SIZE;
+    stream.ahead = last + 1;
+
+    string name = path;
+    readahead_pool.Submit([this, name, first, last]() { Readahead(name, first, last); });
+}
+
+void FileControl::Readahead(const string& path, uint64_t first, uint64_t last)
+{
+    shared_lock<shared_timed_mutex> record_lock(FileLock(path.c_str())); // 打开块表时读文件记录
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry = OpenEntry(path.c_str(), lock, false);
+    if (entry == nullptr || entry->state != CACHE_READY) return; // 已经被删除，或者正在写回，这次不预读
+
+    // 只预读第一段连续的不在缓存中的块，stored_size之后的部分是0，不需要读磁盘
+    uint64_t size = entry->size, stored_size = entry->stored_size;
+    while (first <= last && entry->blocks.find(first) != entry->blocks.end()) first ++;
+    uint64_t stop = first;
+    while (stop <= last && entry->blocks.find(stop) == entry->blocks.end()) stop ++;
+    stop = min(stop, (stored_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (first >= stop) return;
+
+    // 读磁盘和解密时不持有锁，读已经缓存的块不受影响，需要这几块的读者等预读完成
+    entry->state = CACHE_PREFETCHING;
+    lock.unlock();
+    uint64_t begin = first * BLOCK_SIZE;
+    vector<uint8_t> plain(min(stop * BLOCK_SIZE, stored_size) - begin);
+    BlockFile blocks(keys[entry->key_index].aes);
+    bool ok = OpenBlocks(path.c_str(), blocks, false) != -1 && blocks.Read(plain.data(), plain.size(), begin) != -1;
+    if (!ok) LOG_ERROR << "readahead : " << path << " " << strerror(errno);
+
+    lock.lock();
+    entry->state = CACHE_READY;
+    entry->cv.notify_all();
+    if (ok) {
+        lock_guard<mutex> guard(policy_mutex);
+        for(uint64_t block = first; block < stop; block ++) {
+            data_t data = CreateBuffer(block_length(size, block));
+            uint64_t start = block * BLOCK_SIZE - begin;
+            size_t copied = min((uint64_t)data->size(), plain.size() - start);
+            memcpy(data->data(), plain.data() + start, copied);
+            memset(data->data() + copied, 0, data->size() - copied);
+            entry->blocks[block] = data;
+            entry->prefetched.insert(block);
+            policy.Access(BlockKey(path, block));
+            stats.readahead_bytes += data->size();
+        }
+    }
+    lock.unlock();
+    entry.reset();
+    record_lock.unlock();
+    Trim();
 }
 
 int FileControl::NewFile(const char *path, int flags, mode_t mode)
 {
     LOG_INFO << "NewFile: " << path;
 
+    unique_lock<shared_timed_mutex> record_lock(FileLock(path));
     File* x = FindFile(path);
     ASSERT(x == NULL || x->is_deleted);
 
 	int res = open(Resolve(path).c_str(), flags, mode);
     if (res == -1) return res;
-    fsync(res);
+    if (options.durability == DURABILITY_STRICT) fsync(res);
 
     if (x == NULL) {
-        File file;
-        strncpy(file.filename, path, FILENAME_MAX_SIZE);
-        files.push_back(file);
-        x = &files[files.size()-1];
+        x = AddFile(path);
     }
     x->timestamp = time(NULL);
     x->is_deleted = false;
     x->extra_length = 0;
+    x->format = FILE_FORMAT_BLOCK;
+    RandomBytes(x->nonce, sizeof(x->nonce));
 
-    SaveCFG();
+    SaveCFG(x);
+    record_lock.unlock();
     BroadcastFile(path);
 
     return res;
 }
 
-int FileControl::ReadFile(const char *path, int fd, char *buf, size_t size, off_t offset)
+int FileControl::ReadFile(const char *path, int fd, char *buf, size_t size, off_t offset, const FileRef* ref)
 {
     LOG_INFO << "ReadFile: " << path;
-    File *x = FindFile(path);
+    shared_lock<shared_timed_mutex> record_lock(FileLock(path, ref));
+    File* x = ref != NULL ? ref->file : NULL;
+    if (x == NULL) x = FindFile(path);
     ASSERT(x != NULL);
 
-    data_t decoded_data = Touch(path);
-    if (decoded_data == nullptr) return -1;
-
-    size_t file_size = decoded_data->size()-x->extra_length;
-    offset = min((size_t)offset, file_size);
-    size = min(size, file_size-offset);
-    memcpy(buf, decoded_data->data()+offset, size);
-    
-    LOG_INFO << "ReadFile[4]";
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry;
+    if (Migrate(path, x, record_lock) != -1) entry = OpenEntry(path, x, ref != NULL ? ref->handle : NULL, lock);
+    if (entry == nullptr) {
+        errno = EIO;
+        return -1;
+    }
+    int res = ReadCached(path, *entry, lock, (uint8_t*)buf, size, offset);
+    if (res > 0) ScheduleReadahead(path, *entry, fd, offset, res);
+    lock.unlock();
+    entry.reset();
+    record_lock.unlock();
+    Trim();
 
-    return size;
+    return res;
 }
 
-int FileControl::WriteFile(const char *path, int fd, const char *buf, size_t size, off_t offset)
+int FileControl::WriteFile(const char *path, int fd, const char *buf, size_t size, off_t offset, const FileRef* ref)
 {
     LOG_INFO << "WriteFile: " << path;
-    File* x = FindFile(path);
+    unique_lock<shared_timed_mutex> record_lock(FileLock(path, ref));
+    File* x = ref != NULL ? ref->file : NULL;
+    if (x == NULL) x = FindFile(path);
     ASSERT(x != NULL);
 
-    data_t decoded_data = Touch(path, false);
-    size_t file_size = decoded_data->size()-x->extra_length;
-    file_size = max(file_size, offset + size);
-    decoded_data->resize((file_size+15)/16*16);
+    (void) fd;
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry;
+    if (Migrate(path, x) != -1) entry = OpenEntry(path, x, ref != NULL ? ref->handle : NULL, lock);
+    int res = -1;
+    if (entry != nullptr) {
+        res = WriteCached(path, *entry, lock, (const uint8_t*)buf, size, offset);
+        lock.unlock();
+        entry.reset();
+    }
+    if (res != -1) {
+        x->is_deleted = false;
+        x->timestamp = time(NULL);
 
-    memcpy(decoded_data->data()+offset, buf, size);
+        SaveCFG(x);
+    }
+    record_lock.unlock();
+    Trim();
+    if (res == -1) {
+        errno = EIO;
+        return res;
+    }
 
-    x->extra_length = decoded_data->size() - file_size;
-    // if (SaveFile(path, fd, decoded_data) == -1) return -1;
-    x->is_deleted = false;
+    return size;
+}
+
+int FileControl::TruncateFile(const char *path, off_t size, const FileRef* ref)
+{
+    LOG_INFO << "TruncateFile: " << path << " " << size;
+    unique_lock<shared_timed_mutex> record_lock(FileLock(path, ref));
+    File* x = ref != NULL ? ref->file : NULL;
+    if (x == NULL) x = FindFile(path);
+    if (x == NULL) { // 不是通过ShareDisk建立的文件(比如mknod或者直接放进真实文件夹的)
+        errno = EACCES;
+        return -1;
+    }
+
+    unique_lock<mutex> lock;
+    shared_ptr<CacheEntry> entry;
+    if (Migrate(path, x) != -1) entry = OpenEntry(path, x, ref != NULL ? ref->handle : NULL, lock);
+    if (entry == nullptr) {
+        errno = EIO;
+        return -1;
+    }
+    WaitReady(*entry, lock);
+
+    if (entry->dirty.empty() && !entry->resized)
+    { // 没有未写回的修改时直接截断磁盘上的文件，最多只需要重新加密一块
+        entry->state = CACHE_FLUSHING;
+        lock.unlock();
+        BlockFile blocks(keys[entry->key_index].aes);
+        int res = OpenBlocks(path, blocks, true);
+        if (res != -1) res = blocks.Truncate(size);
+        if (res != -1) res = blocks.Sync();
+        if (res == -1) LOG_ERROR << "truncate : " << res << " " << strerror(errno);
+        int err = errno;
+        lock.lock();
+        EndDirectWrite(path, *entry, res != -1, size);
+        lock.unlock();
+        entry.reset();
+        RemoveEntry(path, true);
+        errno = err;
+        if (res == -1) return res;
+
+        x->timestamp = time(NULL);
+        SaveCFG(x);
+        record_lock.unlock();
+        BroadcastFile(path);
+        return res;
+    }
+
+    ResizeEntry(path, *entry, size);
+    entry->last_modify = time(NULL);
+    lock.unlock();
     x->timestamp = time(NULL);
 
-    SaveCFG();
-    // BroadcastFile(path);
+    SaveCFG(x);
 
-    return size;
+    return 0;
 }
 
 int FileControl::DeleteFile(const char *path)
 {
     LOG_INFO << "DeleteFile: " << path;
+    unique_lock<shared_timed_mutex> record_lock(FileLock(path));
     File* x = FindFile(path);
     ASSERT(x != NULL);
 
@@ -301,11 +1062,13 @@ int FileControl::DeleteFile(const char *path)
         LOG_ERROR << "unlink : " << res << " " << strerror(errno);
         return res;
     }
+    RemoveBlocks(x);
 
     x->timestamp = time(NULL);
     x->is_deleted = true;
 
-    SaveCFG();
+    SaveCFG(x);
+    record_lock.unlock();
     BroadcastFile(path);
 
     return res;
@@ -315,10 +1078,27 @@ int FileControl::RenameFile(const char *from, const char *to)
 {
     LOG_INFO << "RenameFile: " << from << " " << to;
 
+    // 两个文件名的锁按地址顺序获取，在同一组时只锁一次
+    shared_timed_mutex* first = &FileLock(from);
+    shared_timed_mutex* second = &FileLock(to);
+    if (first > second) swap(first, second);
+    unique_lock<shared_timed_mutex> first_lock(*first), second_lock;
+    if (second != first) second_lock = unique_lock<shared_timed_mutex>(*second);
+
     File* x = FindFile(from);
     if (x == NULL) return -EACCES;
     // if (FindFile(to) != NULL) return -EACCES;
 
+    // 在锁内写回并删除两个文件的缓存，否则期间对from的写入会留下按旧文件名缓存的脏块，
+    // 之后写回时会用更换过的nonce重新建立from；广播留给下面的BroadcastFile(to)
+    for(const char* path : {from, to}) {
+        if (FlushLocked(path, true) == -1) {
+            errno = EIO;
+            return -1;
+        }
+        RemoveEntry(path, false);
+    }
+
     int res = rename(Resolve(from).c_str(), Resolve(to).c_str());
     if (res == -1) {
         LOG_ERROR << "rename : " << res << " " << strerror(errno);
@@ -329,18 +1109,25 @@ int FileControl::RenameFile(const char *from, const char *to)
     x->is_deleted = true;
     
     File* y = FindFile(to);
+    if (y != NULL && y != x && !y->is_deleted) {
+        RemoveBlocks(y); // 被覆盖的文件的块表
+    }
     if (y == NULL) {
-        File file;
-        strncpy(file.filename, to, FILENAME_MAX_SIZE);
-        files.push_back(file);
-        y = &files[files.size()-1];
+        y = AddFile(to);
     }
     y->timestamp = time(NULL);
     y->is_deleted = false;
     y->extra_length = x->extra_length;
     memcpy(y->extra_data, x->extra_data, 16);
+    y->format = x->format;
+    memcpy(y->nonce, x->nonce, sizeof(y->nonce));
+    if (y != x) {
+        RandomBytes(x->nonce, sizeof(x->nonce)); // 块表已经归y所有，x以后重新创建时使用新的块表
+    }
 
-    SaveCFG();
+    SaveCFG(x, y);
+    first_lock.unlock();
+    if (second_lock.owns_lock()) second_lock.unlock();
     BroadcastFile(from);
     BroadcastFile(to);
 
@@ -354,79 +1141,80 @@ data_t FileControl::LoadFile(const char* path)
     const File* x = FindFile(path);
     //if (x == NULL || x->is_deleted) return nullptr;
     ASSERT(x != NULL && !x->is_deleted);
-
-    int key_index = -1;
-    for(int i = 0; i < (int)keys.size(); i ++)
-        if (keys[i].name == FirstPath(path))
-        {
-            key_index = i;
-        }
-    LOG_INFO << "FirstPath(path) = " << FirstPath(path);
-    LOG_INFO << "key_index = " << key_index;
-    ASSERT(key_index >= 0);
+    const AesKey& key = keys[KeyIndex(path)].aes;
 
     size_t file_size = FileSize(Resolve(path));
     if (file_size == 0) return CreateData();
 
+    if (x->format == FILE_FORMAT_BLOCK) {
+        BlockFile blocks(key);
+        if (OpenBlocks(path, blocks, false) == -1) return nullptr;
+        data_t decoded_data = CreateBuffer(file_size);
+        ssize_t res = blocks.Read(decoded_data->data(), file_size, 0);
+        if (res == -1) {
+            LOG_ERROR << "read blocks : " << res << " " << strerror(errno);
+            return nullptr;
+        }
+        decoded_data->resize(res);
+        return decoded_data;
+    }
+
+    // ECB格式的密文需要补上存放在cfg中的最后不足16字节的部分
+    size_t total_size = x->format == FILE_FORMAT_ECB ? file_size+x->extra_length : file_size;
     data_t file_data = CreateData();
-    data_t decoded_data = CreateData();
-    file_data->resize(file_size+x->extra_length);
-    decoded_data->resize(file_size+x->extra_length);
-    LOG_INFO << file_size << " " << x->extra_length;
-    ASSERT(file_data->size()%16 == 0);
+    file_data->resize(total_size);
+    LOG_INFO << file_size << " " << x->format;
 
     int rfd = open(Resolve(path).c_str(), O_RDONLY);
-    int res = pread(rfd, file_data->data(), file_size, 0);
+    ssize_t res = pread(rfd, file_data->data(), file_size, 0);
+    close(rfd);
     if (res == -1) {
         LOG_ERROR << "pread : " << res << " " << strerror(errno);
         return nullptr;
     }
-    close(rfd);
+    if ((size_t)res != file_size) { // 期间文件被截短了，file_data后面的部分没有初始化，不能当成内容
+        LOG_ERROR << "pread : " << res << " < " << file_size;
+        errno = EIO;
+        return nullptr;
+    }
 
-    memcpy(file_data->data()+file_size, x->extra_data, x->extra_length);
-    aes_decode((uint8_t*)&keys[key_index].key, sizeof(keys[key_index].key), file_data->data(), file_data->size(), decoded_data->data());
+    if (x->format == FILE_FORMAT_ECB) {
+        ASSERT(file_data->size()%16 == 0);
+        data_t decoded_data = CreateData();
+        decoded_data->resize(total_size);
+        memcpy(file_data->data()+file_size, x->extra_data, x->extra_length);
+        aes_decode_parallel(key, file_data->data(), file_data->size(), decoded_data->data());
+        decoded_data->resize(file_size);
+        return decoded_data;
+    }
 
-    return decoded_data;
+    aes_ctr_xor_parallel(key, x->nonce, 0, file_data->data(), file_size, file_data->data());
+    return file_data;
 }
 
-int FileControl::SaveFile(const char* path, int fd, data_t decoded_data)
+int FileControl::SaveFile(const char* path, data_t decoded_data)
 {
     LOG_INFO << "SaveFile: " << path << " " << decoded_data->size();
 
     File* x = FindFile(path);
     ASSERT(x != NULL && !x->is_deleted);
-    ASSERT(decoded_data->size() % 16 == 0);
-    ASSERT(decoded_data->size() >= x->extra_length);
 
-    int key_index = -1;
-    for(int i = 0; i < (int)keys.size(); i ++)
-        if (keys[i].name == FirstPath(path))
-        {
-            key_index = i;
-        }
-    LOG_INFO << "FirstPath(path) = " << FirstPath(path);
-    LOG_INFO << "key_index = " << key_index;
-    ASSERT(key_index >= 0);
-
-    LOG_INFO << decoded_data->size() << " " << x->extra_length;
+    // 旧格式的文件整个重写为BLOCK格式，写完之前不改动原来的文件和记录
+    if (x->format != FILE_FORMAT_BLOCK) return ReplaceFile(path, x, decoded_data);
 
-    data_t file_data = CreateData();
-    file_data->resize(decoded_data->size());
-    
-    aes_encode((uint8_t*)&keys[key_index].key, sizeof(keys[key_index].key), decoded_data->data(), decoded_data->size(), file_data->data());
+    BlockFile blocks(keys[KeyIndex(path)].aes);
+    int res = OpenBlocks(path, blocks, true);
+    if (res == -1) return res;
 
-    int res = pwrite(fd, file_data->data(), file_data->size()-x->extra_length, 0);
+    // 先截短，这样最后一块不需要读出原来的内容
+    size_t size = decoded_data->size();
+    if ((size_t)blocks.Size() > size) res = blocks.Truncate(size);
+    if (res != -1 && blocks.Write(decoded_data->data(), size, 0) == -1) res = -1;
+    if (res != -1) res = blocks.Sync();
     if (res == -1) {
-        LOG_ERROR << "pwrite : " << res << " " << strerror(errno);
+        LOG_ERROR << "write blocks : " << res << " " << strerror(errno);
         return res;
     }
-    res = ftruncate(fd, file_data->size()-x->extra_length);
-    if (res == -1) {
-        LOG_ERROR << "ftruncate : " << res << " " << strerror(errno);
-        return res;
-    }
-    fsync(fd);
-    memcpy(x->extra_data, file_data->data()+(file_data->size()-x->extra_length), x->extra_length);
 
     return res;
 }
@@ -452,32 +1240,262 @@ size_t FileControl::FileSize(const string& filepath) const
     return st.st_size;
 }
 
+string FileControl::BlockMapPath(const File* x) const
+{
+    char name[AES_CTR_NONCE_SIZE*2+1];
+    for(int i = 0; i < AES_CTR_NONCE_SIZE; i ++) {
+        sprintf(name+2*i, "%02x", x->nonce[i]);
+    }
+    return PathJoin(pd_path, string(".blockmap/") + name);
+}
+
+int FileControl::OpenBlocks(const char* path, BlockFile& blocks, bool writable)
+{
+    const File* x = FindFile(path);
+    ASSERT(x != NULL && x->format == FILE_FORMAT_BLOCK);
+
+    int res = blocks.Open(Resolve(path), BlockMapPath(x), writable);
+    if (res == -1) {
+        LOG_ERROR << "open blocks : " << path << " " << strerror(errno);
+    }
+    return res;
+}
+
+void FileControl::RemoveBlocks(File* x)
+{
+    if (x->format != FILE_FORMAT_BLOCK) return;
+    unlink(BlockMapPath(x).c_str());
+    RandomBytes(x->nonce, sizeof(x->nonce));
+}
+
+int FileControl::Migrate(const char* path, File* x)
+{
+    if (x->format == FILE_FORMAT_BLOCK) return 0;
+
+    LOG_INFO << "Migrate: " << path;
+    if (x->is_deleted) { // 没有数据文件，只需要换成BLOCK格式的记录
+        x->format = FILE_FORMAT_BLOCK;
+        x->extra_length = 0;
+        RandomBytes(x->nonce, sizeof(x->nonce));
+        SaveCFG(x);
+        return 0;
+    }
+    data_t decoded_data = LoadFile(path);
+    if (decoded_data == nullptr) return -1;
+    return ReplaceFile(path, x, decoded_data);
+}
+
+int FileControl::Migrate(const char* path, File* x, shared_lock<shared_timed_mutex>& record_lock)
+{
+    if (x->format == FILE_FORMAT_BLOCK) return 0;
+
+    // 读锁不能直接升级，换锁期间可能已经被别的请求转换过，Migrate会再检查一次
+    record_lock.unlock();
+    int res;
+    {
+        unique_lock<shared_timed_mutex> write_lock(*record_lock.mutex());
+        res = Migrate(path, x);
+    }
+    record_lock.lock();
+    return res;
+}
+
+int FileControl::ReplaceFile(const char* path, File* x, const data_t& data)
+{
+    File y = *x;
+    y.format = FILE_FORMAT_BLOCK;
+    y.extra_length = 0;
+    RandomBytes(y.nonce, sizeof(y.nonce));
+    string map_path = BlockMapPath(&y);
+    string temp_path = map_path + ".migrate"; // 和块表放在一起，不会出现在共享的目录中
+    string real_path = Resolve(path);
+
+    BlockFile blocks(keys[KeyIndex(path)].aes);
+    int res = blocks.Open(temp_path, map_path, true);
+    if (res != -1 && blocks.Write(data->data(), data->size(), 0) == -1) res = -1;
+    if (res != -1) res = blocks.Sync();
+    blocks.Close();
+    struct stat st;
+    if (res != -1 && stat(real_path.c_str(), &st) == 0) chmod(temp_path.c_str(), st.st_mode & 07777);
+    if (res == -1) {
+        LOG_ERROR << "replace : " << path << " " << strerror(errno);
+        unlink(temp_path.c_str());
+        unlink(map_path.c_str());
+        return -1;
+    }
+
+    // 新的记录写进日志之后才替换，之前崩溃时RecoverMigrations删除临时文件，之后崩溃时由它完成改名
+    File old = *x;
+    *x = y;
+    SaveCFG(x, NULL, true);
+    if (rename(temp_path.c_str(), real_path.c_str()) == -1) {
+        int err = errno;
+        LOG_ERROR << "replace : rename " << path << " " << strerror(err);
+        *x = old;
+        SaveCFG(x, NULL, true);
+        unlink(temp_path.c_str());
+        unlink(map_path.c_str());
+        errno = err;
+        return -1;
+    }
+    int dir_fd = open(Pathname(real_path).c_str(), O_RDONLY|O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+void FileControl::RecoverMigrations()
+{
+    const char suffix[] = ".migrate";
+    const size_t suffix_length = sizeof(suffix) - 1;
+    string dir = PathJoin(pd_path, ".blockmap");
+    set<string> temps;
+    DIR* dp = opendir(dir.c_str());
+    if (dp == NULL) return;
+    struct dirent* de;
+    while ((de = readdir(dp)) != NULL) {
+        size_t length = strlen(de->d_name);
+        if (length > suffix_length && strcmp(de->d_name + length - suffix_length, suffix) == 0) {
+            temps.insert(PathJoin(dir, de->d_name));
+        }
+    }
+    closedir(dp);
+    if (temps.empty()) return;
+
+    for(const auto& it : file_index) {
+        const File* x = it.second;
+        if (x->format != FILE_FORMAT_BLOCK) continue;
+        auto temp = temps.find(BlockMapPath(x) + suffix);
+        if (temp == temps.end()) continue;
+        LOG_INFO << "RecoverMigrations: finish " << x->filename;
+        if (rename(temp->c_str(), Resolve(x->filename).c_str()) == -1) {
+            LOG_ERROR << "RecoverMigrations: rename " << x->filename << " " << strerror(errno);
+        }
+        temps.erase(temp);
+    }
+    for(const string& temp : temps) { // 记录没有写进日志，原来的文件没有动过
+        LOG_INFO << "RecoverMigrations: drop " << temp;
+        unlink(temp.c_str());
+        unlink(temp.substr(0, temp.length() - suffix_length).c_str());
+    }
+}
+
+int FileControl::KeyIndex(const char* path) const
+{
+    // 同keys[i].name == FirstPath(path)
+    const char* name = path + 1;
+    size_t length = strcspn(name, "/");
+    int key_index = -1;
+    for(int i = 0; i < (int)keys.size(); i ++)
+        if (keys[i].name.compare(0, string::npos, name, length) == 0)
+        {
+            key_index = i;
+        }
+    ASSERT(key_index >= 0);
+    return key_index;
+}
+
 void FileControl::LoadCFG()
 {
     files.clear();
+    file_index.clear();
+    file_paths.clear();
 
     FILE *fd = fopen(cfg_filename.c_str(), "rb");
-    if (!fd) return;
-    
-    File file;
-    while(fread(&file, sizeof(File), 1, fd) > 0)
+    CfgHeader header;
+    if (!fd)
     {
-        files.push_back(file);
+        // 还没有快照，所有的记录都在日志中
     }
+    else if (fread(&header, sizeof(header), 1, fd) == 1 && memcmp(header.magic, cfg_magic, sizeof(cfg_magic)) == 0)
+    {
+        ASSERT(header.record_size == sizeof(File));
+        File file;
+        while(fread(&file, sizeof(File), 1, fd) > 0)
+        {
+            InsertFile(file);
+        }
+    }
+    else
+    {
+        LOG_INFO << "LoadCFG: legacy cfg";
+        fseek(fd, 0, SEEK_SET);
+        LegacyFile legacy;
+        while(fread(&legacy, sizeof(LegacyFile), 1, fd) > 0)
+        {
+            File file;
+            memset(&file, 0, sizeof(file));
+            memcpy(file.filename, legacy.filename, FILENAME_MAX_SIZE);
+            file.timestamp = legacy.timestamp;
+            file.is_deleted = legacy.is_deleted;
+            file.extra_length = legacy.extra_length;
+            memcpy(file.extra_data, legacy.extra_data, 16);
+            file.format = FILE_FORMAT_ECB;
+            InsertFile(file);
+        }
+    }
+    if (fd) fclose(fd);
 
-    fclose(fd);
+    // 日志中是快照之后修改过的记录，按文件名覆盖
+    int res = journal.Open([this](const uint8_t* record) {
+        File file;
+        memcpy(&file, record, sizeof(file));
+        file.filename[FILENAME_MAX_SIZE-1] = '\0';
+        File* x = FindFile(file.filename);
+        if (x != NULL) *x = file;
+        else InsertFile(file);
+    });
+    if (res == -1) { // 不能带着不完整的记录启动，之后的压缩会把它们写进快照
+        LOG_ERROR << "LoadCFG: cannot open journal, refusing to start";
+        exit(1);
+    }
 }
 
-void FileControl::SaveCFG()
+void FileControl::SaveCFG(const File* x, const File* y, bool durable)
 {
-    FILE *fd = fopen(cfg_filename.c_str(), "wb");
+    vector<const void*> records(1, x);
+    if (y != NULL && y != x) records.push_back(y);
+    // strict时每次提交都fdatasync日志，否则写回并fsync过的块表可能比记录它的nonce的记录先到磁盘上
+    journal.Append(records, durable || options.durability == DURABILITY_STRICT);
+}
 
-    for(int i = 0; i < (int)files.size(); i ++)
+void FileControl::CompactCFG()
+{
+    LOG_INFO << "CompactCFG";
+    vector<File> snapshot;
     {
-        fwrite(&files[i], sizeof(File), 1, fd);
+        // 先锁住所有的记录再锁日志，和修改记录之后追加日志的顺序一致
+        vector<shared_lock<shared_timed_mutex>> record_locks;
+        for(int i = 0; i < FILE_LOCK_STRIPES; i ++) record_locks.emplace_back(file_locks[i]);
+        journal.Rotate([&]() {
+            shared_lock<shared_timed_mutex> guard(files_mutex);
+            snapshot.assign(files.begin(), files.end());
+        });
+    }
+
+    // 先写到临时文件再改名，中途出错时原来的快照和日志仍然完整
+    string tmp_filename = cfg_filename + ".tmp";
+    FILE *fd = fopen(tmp_filename.c_str(), "wb");
+    if (!fd) {
+        LOG_ERROR << "CompactCFG : " << strerror(errno);
+        return;
     }
 
-    fclose(fd);
+    CfgHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cfg_magic, sizeof(cfg_magic));
+    header.record_size = sizeof(File);
+    bool ok = fwrite(&header, sizeof(header), 1, fd) == 1;
+    ok = ok && fwrite(snapshot.data(), sizeof(File), snapshot.size(), fd) == snapshot.size();
+    ok = ok && fflush(fd) == 0 && fsync(fileno(fd)) == 0;
+    ok = fclose(fd) == 0 && ok;
+    if (!ok || rename(tmp_filename.c_str(), cfg_filename.c_str()) == -1) {
+        LOG_ERROR << "CompactCFG : " << strerror(errno);
+        return;
+    }
+    journal.DropOld();
 }
 
 void debug(data_t data, int pos = 0)
@@ -487,6 +1505,123 @@ void debug(data_t data, int pos = 0)
     }
 }
 
+void FileControl::HandlePacket(const Slice& data)
+{
+    // 内容在收到的包中，包头之后不一定对齐，用memcpy读出结构体
+    if (data.size < sizeof(PacketHead)) {
+        LOG_ERROR << "packet size too small";
+        return;
+    }
+    PacketHead head;
+    memcpy(&head, data.data(), sizeof(head));
+    head.filename[FILENAME_MAX_SIZE-1] = '\0';
+    if (head.type == packet_type_online) {
+        LOG_INFO << "packet_type_online";
+        for(const auto& name : FilesWithPrefix(("/" + string(head.filename) + "/").c_str())) {
+            BroadcastFile(name.c_str());
+        }
+    } else if (head.type == packet_type_modify) {
+        LOG_INFO << "packet_type_modify " << head.filename;
+        ModifyPacket modify;
+        if (data.size < sizeof(PacketHead)+sizeof(ModifyPacket)) {
+            LOG_ERROR << "modify packet size unmatch";
+            return;
+        }
+        memcpy(&modify, data.data()+sizeof(PacketHead), sizeof(modify));
+        if (data.size != sizeof(PacketHead)+sizeof(ModifyPacket)+modify.payload_size) {
+            LOG_ERROR << "modify packet size unmatch";
+            return;
+        }
+
+        unique_lock<shared_timed_mutex> record_lock(FileLock(head.filename));
+        File* x = FindFile(head.filename);
+        if (x != NULL && x->timestamp > head.time) return;
+        if (x == NULL) {
+            x = AddFile(head.filename);
+
+            char buf[FILENAME_MAX_SIZE*2];
+            sprintf(buf, "mkdir -p %s", Pathname(Resolve(x->filename)).c_str());
+            system(buf);
+
+            int fd = open(Resolve(x->filename).c_str(), O_WRONLY|O_CREAT, 0666);
+            if (options.durability == DURABILITY_STRICT) fsync(fd);
+            close(fd);
+        }
+        x->is_deleted = false;
+
+        ASSERT(modify.payload_offset + modify.payload_size <= modify.total_size);
+        ASSERT(modify.file_size <= modify.total_size);
+        const uint8_t* payload = data.data()+sizeof(PacketHead)+sizeof(ModifyPacket);
+
+        // 包中的内容按16字节补齐，只写入文件长度以内的部分
+        int64_t size = min(modify.payload_size, max(modify.file_size - modify.payload_offset, (int64_t)0));
+
+        if (Migrate(x->filename, x) == -1) return;
+        unique_lock<mutex> lock;
+        shared_ptr<CacheEntry> entry = OpenEntry(x->filename, lock, true, x);
+        ASSERT(entry != nullptr);
+        WaitReady(*entry, lock);
+        int res;
+        if (entry->dirty.empty() && !entry->resized)
+        { // 没有未写回的修改时直接写入对应的块，不经过缓存，被覆盖的块从缓存中删除
+            if (size > 0) DropBlocks(x->filename, *entry, modify.payload_offset / BLOCK_SIZE, (modify.payload_offset + size - 1) / BLOCK_SIZE);
+            entry->state = CACHE_FLUSHING;
+            lock.unlock();
+            BlockFile blocks(keys[entry->key_index].aes);
+            res = OpenBlocks(x->filename, blocks, true);
+            if (res != -1) res = blocks.Write(payload, size, modify.payload_offset);
+            if (res != -1 && blocks.Size() != modify.file_size) res = blocks.Truncate(modify.file_size);
+            // 没有经过缓存，不会被写回：strict时在这里fsync，batched时等下一次SyncFiles的syncfs
+            if (res != -1 && options.durability == DURABILITY_STRICT) res = blocks.Sync();
+            if (res != -1 && options.durability != DURABILITY_STRICT) received_unsynced = true;
+            if (res == -1) LOG_ERROR << "write blocks : " << res << " " << strerror(errno);
+            lock.lock();
+            EndDirectWrite(x->filename, *entry, res != -1, modify.file_size);
+        }
+        else
+        {
+            res = WriteCached(x->filename, *entry, lock, payload, size, modify.payload_offset);
+            if (res != -1) ResizeEntry(x->filename, *entry, modify.file_size);
+        }
+        lock.unlock();
+        entry.reset();
+        RemoveEntry(x->filename, true);
+        if (res != -1) {
+            x->timestamp = head.time;
+
+            SaveCFG(x);
+        }
+        record_lock.unlock();
+        Trim();
+        if (res == -1) return;
+        if (change_handler) change_handler(head.filename);
+    } else if (head.type == packet_type_delete) {
+        LOG_INFO << "packet_type_delete " << head.filename;
+        File* x = FindFile(head.filename);
+        if (x == NULL) return;
+        {
+            shared_lock<shared_timed_mutex> record_lock(FileLock(head.filename));
+            if (x->timestamp > head.time) return;
+        }
+        Sync(head.filename);
+        ClearCache(head.filename);
+        // Sync不能持有记录的锁，之后重新检查期间有没有新的修改
+        unique_lock<shared_timed_mutex> record_lock(FileLock(head.filename));
+        if (x->timestamp > head.time) return;
+        if (x->is_deleted == false) {
+            unlink(Resolve(x->filename).c_str());
+            RemoveBlocks(x);
+        }
+        x->timestamp = head.time;
+        x->is_deleted = true;
+        SaveCFG(x);
+        record_lock.unlock();
+        if (change_handler) change_handler(head.filename);
+    } else {
+        LOG_ERROR << "unknow packet type";
+    }
+}
+
 void FileControl::StartThread()
 {
     recv_thread = thread([this]() {
@@ -497,159 +1632,128 @@ void FileControl::StartThread()
             for(int i = 0; i < (int)keys.size(); i ++) {
                 memset(head.filename, '\0', FILENAME_MAX_SIZE);
                 strncpy(head.filename, keys[i].name.c_str(), FILENAME_MAX_SIZE);
-                net->Broadcast(keys[i].key, CreateData(&head, sizeof(head)));
-            }
-        }
-        while(true)
-        {
-            data_t data = net->Recv();
-            if (data->size() < sizeof(PacketHead)) {
-                LOG_ERROR << "packet size too small";
-                continue;
-            }
-            PacketHead head = *(PacketHead*)data->data();
-            head.filename[FILENAME_MAX_SIZE-1] = '\0';
-            if (head.type == packet_type_online) {
-                LOG_INFO << "packet_type_online";
-                for(int i = 0; i < (int)files.size(); i ++) {
-                    if (FirstPath(files[i].filename) == head.filename) {
-                        BroadcastFile(files[i].filename);
-                    }
-                }
-            } else if (head.type == packet_type_modify) {
-                LOG_INFO << "packet_type_modify " << head.filename;
-                ModifyPacket modify = *(ModifyPacket*)(data->data()+sizeof(PacketHead));
-                if (data->size() != sizeof(PacketHead)+sizeof(ModifyPacket)+modify.payload_size) {
-                    LOG_ERROR << "modify packet size unmatch";
-                    continue;
-                }
-
-                File* x = FindFile(head.filename);
-                if (x != NULL && x->timestamp > head.time) continue;
-                if (x == NULL) {
-                    File file;
-                    memcpy(file.filename, head.filename, FILENAME_MAX_SIZE);
-                    files.push_back(file);
-                    x = &files[files.size()-1];
-
-                    char buf[FILENAME_MAX_SIZE*2];
-                    sprintf(buf, "mkdir -p %s", Pathname(Resolve(file.filename)).c_str());
-                    system(buf);
-
-                    int fd = open(Resolve(file.filename).c_str(), O_WRONLY|O_CREAT, 0666);
-                    fsync(fd);
-                    close(fd);
-                }
-                x->is_deleted = false;
-
-                data_t decoded_data = Touch(x->filename, false);
-                ASSERT(decoded_data != nullptr);
-                decoded_data->resize(modify.total_size);
-                ASSERT(decoded_data->size() % 16 == 0);
-                memcpy(decoded_data->data()+modify.payload_offset, data->data()+sizeof(PacketHead)+sizeof(ModifyPacket), modify.payload_size);
-
-                x->extra_length = modify.total_size - modify.file_size;
-                x->timestamp = head.time;
-                
-                SaveCFG();
-            } else if (head.type == packet_type_delete) {
-                LOG_INFO << "packet_type_delete " << head.filename;
-                File* x = FindFile(head.filename);
-                if (x == NULL || x->timestamp > head.time) continue;
-                Sync(head.filename);
-                ClearCache(head.filename);
-                if (x->is_deleted == false) {
-                    unlink(Resolve(x->filename).c_str());
-                }
-                x->timestamp = head.time;
-                x->is_deleted = true;
-                SaveCFG();
-            } else {
-                LOG_ERROR << "unknow packet type";
+                net->Broadcast(i, CreateData(&head, sizeof(head)));
             }
         }
+        while(true) HandlePacket(net->Recv());
     });
 
+    StartSyncThread();
+}
+
+void FileControl::StartSyncThread()
+{
     sync_thread = thread([this]() {
         while(true) {
 
             { // need sync
-                sync_mutex.lock();
                 vector<string> files;
-                for(auto it: file_cache) {
-                    if (is_dirty.at(it.first) && last_modify.at(it.first)+2<time(NULL)) { // 距上次修改超过2秒钟则同步
+                for(const auto& it: Entries()) {
+                    lock_guard<mutex> guard(it.second->lock);
+                    const CacheEntry& entry = *it.second;
+                    if ((!entry.dirty.empty() || entry.resized || entry.unsent) && entry.last_modify+2<time(NULL)) { // 距上次修改超过2秒钟则同步
                         files.push_back(it.first);
                     }
                 }
-                sync_mutex.unlock();
-                for(const auto& name: files) {
-                    Sync(name.c_str());
-                }
-            }
-            
-            { // need free
-                sync_mutex.lock();
-                vector<string> files;
-                for(auto it: file_cache) {
-                    if (last_hit.at(it.first)+30<time(NULL)) { // 距上次访问超过30秒钟则释放内存
-                        files.push_back(it.first);
-                    }
-                }
-                sync_mutex.unlock();
-                for(const auto& name: files) {
-                    ClearCache(name.c_str());
-                }
+                SyncFiles(files);
             }
 
-            this_thread::sleep_for(chrono::seconds(1));
+            uint64_t records;
+            {
+                shared_lock<shared_timed_mutex> guard(files_mutex);
+                records = files.size();
+            }
+            if (journal.Size() > max((uint64_t)JOURNAL_COMPACT_SIZE, records * sizeof(File))) {
+                CompactCFG();
+            }
+            
+            unique_lock<mutex> lock(stop_mutex);
+            if (stop_cv.wait_for(lock, chrono::seconds(1), [this]() { return stopping; })) return;
         }
     });
 }
 
 void FileControl::BroadcastFile(const char* path)
 {
-    File* x = FindFile(path);
-    ASSERT(x != NULL);
-    
-    int key_index = -1;
-    for(int i = 0; i < (int)keys.size(); i ++)
-        if (FirstPath(path) == keys[i].name) {
-            key_index = i;
-        }
-    ASSERT(key_index >= 0);
+    File x;
+    {
+        shared_lock<shared_timed_mutex> record_lock(FileLock(path));
+        const File* record = FindFile(path);
+        ASSERT(record != NULL);
+        x = *record;
+    }
+    int key_index = KeyIndex(path);
 
-    if (x->is_deleted) {
-        LOG_INFO << "send delete " << x->filename;
+    if (x.is_deleted) {
+        LOG_INFO << "send delete " << x.filename;
         PacketHead head;
         head.type = packet_type_delete;
-        head.time = x->timestamp-1;
-        memcpy(head.filename, x->filename, FILENAME_MAX_SIZE);
-        net->Broadcast(keys[key_index].key, CreateData(&head, sizeof(head)));
+        head.time = x.timestamp-1;
+        memcpy(head.filename, x.filename, FILENAME_MAX_SIZE);
+        net->Broadcast(key_index, CreateData(&head, sizeof(head)));
     } else {
-        data_t decoded_data = Touch(path);
-        LOG_INFO << "send modify " << x->filename << " " << decoded_data->size() << " " << x->extra_length;
+        // 每段在锁住这个文件时读取，缓存中的块从缓存读，其它的块直接从磁盘读，不放进缓存
+        unique_lock<mutex> lock;
+        shared_ptr<CacheEntry> entry;
+        size_t file_size;
+        {
+            shared_lock<shared_timed_mutex> record_lock(FileLock(path));
+            File* record = FindFile(path);
+            if (record == NULL || Migrate(path, record, record_lock) == -1) return; // 旧格式的文件先转换
+            entry = OpenEntry(path, lock, true, record);
+            if (entry == nullptr) return;
+            file_size = entry->size;
+            lock.unlock();
+            entry.reset();
+        }
+
+        // 为了兼容旧版本，发送的内容按16字节补齐，补齐的部分为0
+        size_t total_size = (file_size + 15) / 16 * 16;
+        LOG_INFO << "send modify " << x.filename << " " << file_size;
         for(int i = 0; i < 5; ++i) {
-            for(size_t pos = 0; pos == 0 || pos < decoded_data->size(); pos += CHUNK_MAX_SIZE) {
-                int size = min((int)CHUNK_MAX_SIZE, (int)decoded_data->size() - (int)pos);
+            for(size_t pos = 0; pos == 0 || pos < total_size; pos += CHUNK_MAX_SIZE) {
+                size_t size = min((size_t)CHUNK_MAX_SIZE, total_size - pos);
 
                 PacketHead head;
                 head.type = packet_type_modify;
-                head.time = x->timestamp-1;
-                memcpy(head.filename, x->filename, FILENAME_MAX_SIZE);
+                head.time = x.timestamp-1;
+                memcpy(head.filename, x.filename, FILENAME_MAX_SIZE);
                 ModifyPacket modify;
-                modify.file_size = decoded_data->size()-x->extra_length;
-                modify.total_size = decoded_data->size();
+                modify.file_size = file_size;
+                modify.total_size = total_size;
                 modify.payload_offset = pos;
                 modify.payload_size = size;
 
-                data_t data = CreateData();
-                data->resize(sizeof(head)+sizeof(modify)+size);
-                memcpy(data->data(), &head, sizeof(head));
-                memcpy(data->data()+sizeof(head), &modify, sizeof(modify));
-                memcpy(data->data()+sizeof(head)+sizeof(modify), decoded_data->data()+pos, size);
+                // 包头单独一段，内容直接引用缓存中的块，加密时才拼到一起
+                data_t header = CreateBuffer(sizeof(head)+sizeof(modify));
+                memcpy(header->data(), &head, sizeof(head));
+                memcpy(header->data()+sizeof(head), &modify, sizeof(modify));
+                vector<Slice> slices(1, Slice(header));
+                size_t valid = min(size, file_size-pos);
+                int res = -1;
+                {
+                    shared_lock<shared_timed_mutex> record_lock(FileLock(path));
+                    entry = OpenEntry(path, lock);
+                    if (entry != nullptr) {
+                        res = ReadSlices(path, *entry, lock, valid, pos, slices);
+                        lock.unlock();
+                        entry.reset();
+                    }
+                }
+                if (res == -1) {
+                    LOG_ERROR << "send modify : " << strerror(errno);
+                    RemoveEntry(path, true);
+                    return;
+                }
+                if ((size_t)res < size) { // 补齐的部分，以及期间文件被截短的部分
+                    data_t padding = CreateBuffer(size-res);
+                    memset(padding->data(), 0, padding->size());
+                    slices.push_back(Slice(padding));
+                }
 
-                net->Broadcast(keys[key_index].key, data);
+                net->Broadcast(key_index, slices);
             }
         }
+        RemoveEntry(path, true); // 只为广播打开的项不保留
     }
 }
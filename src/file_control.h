@@ -2,15 +2,30 @@
 #define _FILE_CONTROL_H_
 
 #include <memory>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
 #include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <functional>
 
 #include "common.h"
+#include "aes.h"
+#include "aes_ctr.h"
+#include "block_store.h"
+#include "arc.h"
+#include "journal.h"
 #include "networking.h"
+#include "thread_pool.h"
 #include "protocol.h"
 
 using namespace std;
@@ -20,15 +35,124 @@ struct KeyEntry
     string name;
     string keystring;
     SecretKey key;
+    AesKey aes; // 扩展后的key，构造时生成一次
 };
 
+#define FILE_FORMAT_ECB 0 // 旧格式：整个文件ECB加密，补齐到16字节的部分存在extra_data中
+#define FILE_FORMAT_CTR 1 // CTR模式，每个文件一个随机nonce，密文长度等于明文长度，可以只解密任意一段
+#define FILE_FORMAT_BLOCK 2 // 分块加密，见BlockFile，块表存放在.blockmap目录下以nonce命名的文件中
+
 struct File
 {
     char filename[FILENAME_MAX_SIZE];
     time_t timestamp;
     bool is_deleted;
-    uint32_t extra_length;
-    uint8_t extra_data[16];
+    uint32_t extra_length; // 仅用于FILE_FORMAT_ECB
+    uint8_t extra_data[16]; // 仅用于FILE_FORMAT_ECB
+    uint32_t format; // FILE_FORMAT_*，旧格式的文件在第一次载入时转换为BLOCK格式
+    uint8_t nonce[AES_CTR_NONCE_SIZE]; // FILE_FORMAT_CTR中为CTR的nonce，FILE_FORMAT_BLOCK中为块表的文件名
+};
+
+#define FILE_LOCK_STRIPES 64 // 文件记录的读写锁按文件名的hash分成多组
+
+#define CACHE_SHARDS 16 // 缓存按文件名的hash分成多组，每组一个锁
+
+#define CACHE_LOADING 0 // 正在打开文件，其它请求等待
+#define CACHE_READY 1
+#define CACHE_FLUSHING 2 // 正在写回磁盘，只能读已经缓存的块，修改和从磁盘载入需要等待
+#define CACHE_PREFETCHING 3 // 正在预读，和FLUSHING一样只能读已经缓存的块
+
+#define READAHEAD_WORKERS 2 // 预读线程数
+#define READAHEAD_MIN_WINDOW (4*BLOCK_SIZE) // 刚发现顺序读时的预读窗口，之后每次加倍直到--readahead
+
+// 一个打开的文件(按fd区分)的读取位置，用于发现顺序读
+struct ReadStream
+{
+    uint64_t next; // 上次读到的位置，从这里开始读算顺序读
+    uint64_t window; // 当前的预读窗口，0表示不是顺序读
+    uint64_t ahead; // 已经安排预读到这一块之前
+};
+
+// 缓存中的一个文件，只保存读写过并且还没有被淘汰的块，除最后一块外每块都是BLOCK_SIZE字节
+// 以下成员由lock保护，读写磁盘时只持有这个文件的锁，写回时连它也不持有
+struct CacheEntry
+{
+    mutex lock;
+    condition_variable cv; // state改变或者项被删除时通知
+    int state; // CACHE_*
+    bool removed; // 已经从分组中删除，拿到它的请求需要重新查找
+    uint64_t size; // 明文长度，写回之前可能和磁盘上的不同
+    uint64_t stored_size; // 磁盘上这个长度之前的内容仍然有效，之后的部分写回前都视为0
+    map<uint64_t, data_t> blocks; // 块号 -> 明文
+    set<uint64_t> dirty; // 修改之后还没有写回的块
+    bool resized; // 长度改变之后还没有写回
+    bool unsent; // 淘汰时已经写回，但是还没有广播
+    int key_index; // 建立时按第一级目录找到的密钥，读写磁盘时不用再解析路径
+    time_t last_modify;
+    set<uint64_t> prefetched; // 预读进来还没有被读过的块
+    map<int, ReadStream> streams; // fd -> 读取位置
+};
+
+struct CacheShard
+{
+    mutex lock; // 只在查找、插入和删除项时持有，不做磁盘读写；先锁分组再锁项
+    map<string, shared_ptr<CacheEntry>, less<>> entries; // 可以直接用const char*查找
+};
+
+// 前端为每个文件保存一个，操作时传入，上次用的缓存项还在时不需要按文件名查找
+// 不持有缓存项，项被淘汰或者删除之后下次使用时重新查找
+struct FileHandle
+{
+    mutex lock; // 保护以下成员，同一个文件可以同时有多个操作
+    const File* file; // entry所属的文件记录，和这次操作的记录不同时(比如文件被移走了)不使用entry
+    weak_ptr<CacheEntry> entry;
+};
+
+// 前端已经为一个路径解析好的信息，传给FileControl之后不再拼接、解析和查找这个路径
+struct FileRef
+{
+    const char* real; // 真实文件夹中的路径，同Resolve(path)
+    size_t hash; // PathHash()(path)，用于找记录锁
+    File* file; // 文件记录，NULL时按路径查找
+    FileHandle* handle; // 可以为NULL
+};
+
+struct PathLess
+{
+    bool operator()(const char* a, const char* b) const { return strcmp(a, b) < 0; }
+};
+// 按字典序排列的路径，以同一个前缀开头的路径(比如同一个目录下的所有文件)是连续的一段
+// 只保存指针，指向的字符串由别处保存并且在删除之前不会移动
+typedef set<const char*, PathLess> PathSet;
+
+// 按内容比较和计算hash的路径，查找时直接用传进来的const char*，不构造string
+struct PathHash
+{
+    size_t operator()(const char* path) const
+    {
+        uint64_t h = 14695981039346656037ULL; // FNV-1a
+        for(; *path; path ++) h = (h ^ (uint8_t)*path) * 1099511628211ULL;
+        return (size_t)h;
+    }
+};
+struct PathEqual
+{
+    bool operator()(const char* a, const char* b) const { return strcmp(a, b) == 0; }
+};
+
+struct CacheStats
+{
+    uint64_t hits; // 按块计算
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t dirty_evictions; // 淘汰前需要先写回的次数
+    uint64_t flushes; // 写回的次数
+    uint64_t flush_bytes; // 写回时加密并写入磁盘的字节数
+    uint64_t cached_bytes; // 当前缓存的明文字节数
+    uint64_t budget_bytes; // --cache-size
+    uint64_t readahead_bytes; // 预读载入的字节数
+    uint64_t readahead_hits; // 读到预读进来的块的次数，按块计算
+    uint64_t readahead_wasted; // 预读进来没有被读过就被淘汰或者删除的字节数
 };
 
 class FileControl
@@ -38,53 +162,139 @@ public:
     ~FileControl();
 
     void Init();
+    // 收到其它节点的修改或删除并写入磁盘之后，在接收线程中以文件名调用handler，需要在Init之前设置
+    void SetChangeHandler(function<void(const char*)> handler);
+    // 替换发送数据包的方式(见Networking::SetSender)，比如bench中不发到网络上，需要在开始读写之前设置
+    void SetSender(function<void(const data_t&)> sender);
+    // 启动后台同步线程，Init会调用；不监听网络时(比如bench)可以单独调用，析构时停止
+    void StartSyncThread();
+    // 处理一个收到并解密的数据包，接收线程对每个包调用；bench直接用它注入其它节点的修改和删除
+    void HandlePacket(const Slice& data);
 
     string Resolve(const string& path) const;
     string Pathname(const string& path) const;
     bool IsAccessible(const char *path) const; // path是否可访问
     bool IsTopLevel(const char *path) const; // path是否是根目录或者一级目录
     vector<string> KeyNames() const;
+    int KeyIndex(const char* path) const; // path第一级目录对应的密钥在KeyNames()中的下标，不构造string
 
+    // 返回的指针一直有效，读写它指向的记录需要持有FileLock(path)
     File* FindFile(const char *path);
+    File* AddFile(const char *path); // 新建一条BLOCK格式的文件记录，已经有同名的记录时返回它
 
-    void Sync(const char *path); // 如果有更新，将缓存同步到磁盘上
+    // lstat真实文件，长度取缓存中还没有写回的长度，修改时间取文件记录中的时间，不写回也不广播
+    // ref为前端解析好的path，NULL时按path查找；失败返回-1并设置errno
+    int Stat(const char *path, struct stat *st, const FileRef* ref = NULL);
+    void Sync(const char *path); // 如果有更新，将缓存同步到磁盘上并广播
+    // 只把修改过的块写回磁盘，不广播；返回1表示写回了，0表示不需要写回
+    // durable为false时不fsync，调用者之后需要SyncAll
+    int FlushFile(const char *path, bool durable = true);
+    int SyncAll(); // 一次把真实文件夹所在文件系统上所有的修改写到磁盘
     void SyncDir(const char *path); // 如果有更新，将缓存同步到磁盘上
+    // 同步一批文件：DURABILITY_BATCHED时先全部写回，一次SyncAll之后再广播；否则逐个Sync
+    void SyncFiles(const vector<string>& paths);
     void ClearCache(const char *path); // 删除缓存
+    CacheStats Stats();
 
     int NewFile(const char *path, int flags, mode_t mode);
-    int ReadFile(const char *path, int fd, char *buf, size_t size, off_t offset);
-    int WriteFile(const char *path, int fd, const char *buf, size_t size, off_t offset);
+    // ref同Stat；ref->handle不为NULL时先用其中保存的缓存项，打开缓存项之后保存到其中
+    int ReadFile(const char *path, int fd, char *buf, size_t size, off_t offset, const FileRef* ref = NULL);
+    int WriteFile(const char *path, int fd, const char *buf, size_t size, off_t offset, const FileRef* ref = NULL);
+    int TruncateFile(const char *path, off_t size, const FileRef* ref = NULL); // path没有文件记录时返回-1，errno为EACCES
     int DeleteFile(const char *path);
-    int RenameFile(const char *from, const char *to);
+    int RenameFile(const char *from, const char *to); // 先写回并删除两个文件的缓存，不需要调用者Sync
+
+    data_t LoadFile(const char* path); // 从磁盘上载入并解码，不管理缓存
+    int SaveFile(const char* path, data_t decoded_data); // 加密并写入磁盘文件，不管理缓存
 
 private:
     string PathJoin(string A, string B) const;
     string FirstPath(const string& path) const;
     size_t FileSize(const string& filepath) const;
-    void LoadCFG();
-    void SaveCFG();
+    string BlockMapPath(const File* x) const;
+    int OpenBlocks(const char* path, BlockFile& blocks, bool writable); // 仅用于BLOCK格式，需要持有path的记录锁
+    int FlushLocked(const char *path, bool durable); // 同FlushFile，调用者已经持有path的记录锁
+    void RemoveBlocks(File* x); // 删除块表并更换nonce，用于文件被删除或移走之后
+    // 旧格式的文件整个重写为BLOCK格式，已经是BLOCK格式时什么也不做；需要持有path的记录写锁
+    int Migrate(const char* path, File* x);
+    // 同上，调用者持有记录的读锁，需要转换时暂时换成写锁，返回时仍然持有读锁
+    int Migrate(const char* path, File* x, shared_lock<shared_timed_mutex>& record_lock);
+    // 把data写成新的BLOCK格式的文件替换原来的数据文件，需要持有path的记录写锁
+    // 先写到临时的数据文件和新的块表并fsync，日志中记下新的记录之后才改名替换，中途崩溃时原来的文件和记录不变
+    int ReplaceFile(const char* path, File* x, const data_t& data);
+    void RecoverMigrations(); // 启动时处理ReplaceFile中途崩溃留下的临时文件：记录已经写进日志的完成改名，否则删除
+    File* InsertFile(const File& file); // 加入files并建立索引，同名的记录只索引第一条；需要files_mutex的写锁，启动时的LoadCFG除外
+    // 记录所在组的读写锁：修改记录以及对应的磁盘文件和块表时持有写锁，读记录时持有读锁
+    // 先锁记录再锁缓存和日志；持有时不调用Sync和BroadcastFile，它们自己会获取读锁
+    shared_timed_mutex& FileLock(const char* path);
+    shared_timed_mutex& FileLock(size_t hash); // hash为PathHash()(path)
+    shared_timed_mutex& FileLock(const char* path, const FileRef* ref); // ref不为NULL时用前端算好的hash
+    void LoadCFG(); // 载入快照并重放日志
+    // 把修改过的记录追加到日志中，durable或者DURABILITY_STRICT时还fdatasync日志；batched时日志由SyncFiles的syncfs保证
+    void SaveCFG(const File* x, const File* y = NULL, bool durable = false);
+    void CompactCFG(); // 把所有记录写成新的快照，清空日志
 
-    data_t Touch(const char *path, bool readonly = true);
+    CacheShard& Shard(const char* path);
+    vector<pair<string, shared_ptr<CacheEntry>>> Entries(); // 所有缓存项的快照，之后读项的内容需要再锁住项
+    vector<string> CachedWithPrefix(const char *prefix); // 以prefix开头的缓存项
+    vector<string> FilesWithPrefix(const char *prefix); // 以prefix开头的文件记录
+    // 找到或者建立缓存项，建立时文件需要已经是BLOCK格式(见Migrate)；返回时lock持有项的锁，状态不是LOADING
+    // 同一个文件同时只有一个请求在打开，其它请求等它完成；create为true时调用者需要持有path的记录锁
+    // x为path的文件记录，NULL时查找
+    shared_ptr<CacheEntry> OpenEntry(const char *path, unique_lock<mutex>& lock, bool create = true, File* x = NULL);
+    // 同上，先试handle中保存的项，打开的项保存到handle中；handle为NULL时同OpenEntry(path, lock, create, x)
+    shared_ptr<CacheEntry> OpenEntry(const char *path, File* x, FileHandle* handle, unique_lock<mutex>& lock, bool create = true);
+    void RemoveEntry(const string& path, bool empty_only); // 等到状态为READY后从缓存中删除；empty_only时只删除没有块并且不需要同步的项
+    // 缓存超过预算时按ARC淘汰，脏块在拿到所属文件的记录锁时先写回，否则留到下次；调用时不能持有任何项的锁和记录锁
+    void Trim();
+    // 记录对[first, last]的访问；prefetched中的块预读时已经记录过一次，第一次读不再记录
+    void Touch(const char *path, uint64_t first, uint64_t last, set<uint64_t>* prefetched = NULL);
+    void Readahead(const string& path, uint64_t first, uint64_t last); // 在预读线程中载入[first, last]中不在缓存里的块
 
-    data_t LoadFile(const char* path); // 从磁盘上载入并解码，不管理缓存
-    int SaveFile(const char* path, int fd, data_t decoded_data); // 写入磁盘文件并加密，不管理缓存
+    // 以下函数需要持有entry.lock
+    void WaitReady(CacheEntry& entry, unique_lock<mutex>& lock);
+    int LoadBlocks(const char *path, CacheEntry& entry, uint64_t first, uint64_t last); // 读入[first, last]中不在缓存里的块，需要READY
+    void ResizeEntry(const char *path, CacheEntry& entry, uint64_t size); // 需要READY
+    bool WaitBlocks(CacheEntry& entry, unique_lock<mutex>& lock, uint64_t first, uint64_t last); // 等到READY返回true，[first, last]都已缓存时返回false
+    int ReadCached(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, uint8_t *buf, size_t size, uint64_t offset);
+    // 用于广播，缓存中的块不复制，直接引用；不在缓存中的块从磁盘读到新的缓冲中，不放进缓存
+    int ReadSlices(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, size_t size, uint64_t offset, vector<Slice>& out);
+    int WriteCached(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, const uint8_t *buf, size_t size, uint64_t offset);
+    int Flush(const char *path, CacheEntry& entry, unique_lock<mutex>& lock, bool durable); // 写回脏块和长度的变化，写磁盘时释放锁，需要READY
+    void DropBlocks(const char *path, CacheEntry& entry, uint64_t first, uint64_t last); // 删除[first, last]中缓存的块，不能有脏块
+    void ScheduleReadahead(const char *path, CacheEntry& entry, int fd, uint64_t offset, size_t size); // 一次读之后更新读取位置，顺序读时安排预读
+    // 没有脏块时可以绕过缓存直接修改磁盘上的文件：调用者把状态设为FLUSHING，释放锁后读写磁盘，完成后重新加锁调用这个函数
+    void EndDirectWrite(const char *path, CacheEntry& entry, bool ok, uint64_t size);
 
-    void StartThread();
+    void StartThread(); // 接收线程和同步线程，接收线程一直运行到进程退出
     void BroadcastFile(const char* path);
 
 private:
     string pd_path;
     string cfg_filename;
-    vector<File> files;
+    int pd_fd; // 真实文件夹，用于syncfs
+    Journal journal;
+    shared_timed_mutex files_mutex; // 保护files、file_index和file_paths本身，记录的内容由file_locks保护
+    shared_timed_mutex file_locks[FILE_LOCK_STRIPES];
+    deque<File> files; // 按cfg中的顺序，push_back不会移动已有的记录
+    unordered_map<const char*, File*, PathHash, PathEqual> file_index; // 文件名 -> files中的记录，键指向记录中的filename
+    PathSet file_paths; // 所有记录的文件名，用于按目录查找
     vector<KeyEntry> keys;
     Networking* net;
+    function<void(const char*)> change_handler;
 
     thread recv_thread, sync_thread;
-    mutex sync_mutex;
-    map<string, time_t> last_hit;
-    map<string, time_t> last_modify;
-    map<string, data_t> file_cache;
-    map<string, bool> is_dirty;
+    mutex stop_mutex; // 保护stopping
+    condition_variable stop_cv;
+    bool stopping; // 析构时通知同步线程退出
+    CacheShard shards[CACHE_SHARDS];
+    mutex cache_paths_mutex; // 保护cache_paths，先锁分组再锁它
+    PathSet cache_paths; // 所有缓存项的文件名，指向分组中的键
+    mutex policy_mutex; // 保护policy和stats，持有时不再获取其它锁
+    ArcPolicy policy;
+    CacheStats stats;
+    atomic<bool> received_unsynced; // batched时接收线程直接写入了磁盘，下一次SyncFiles需要syncfs
+    ThreadPool readahead_pool; // 最后一个成员，最先析构，等正在进行的预读结束
 };
 
 #endif // _FILE_CONTROL_H_
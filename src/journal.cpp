@@ -0,0 +1,198 @@
+#include "journal.h"
+#include <plog/Log.h>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char journal_magic[8] = {'S', 'D', 'J', 'N', 'L', '\0', '\0', '\1'};
+
+struct JournalHeader
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+// FNV-1a，只用来发现写了一半的记录
+static uint32_t checksum(const uint8_t* data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < size; i ++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static ssize_t write_full(int fd, const uint8_t* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = write(fd, buf+done, size-done);
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1) return -1;
+        done += res;
+    }
+    return done;
+}
+
+Journal::Journal(const string& path, uint32_t record_size)
+    : path(path), old_path(path + ".old"), record_size(record_size), fd(-1), size(0),
+      writing(false), queued(0), committed(0), pending_durable(false)
+{
+}
+
+Journal::~Journal()
+{
+    if (fd != -1) close(fd);
+}
+
+int Journal::Replay(const string& path, function<void(const uint8_t*)> replay, uint64_t& valid_size)
+{
+    valid_size = 0;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) return 0;
+
+    // 新建时写了一半的文件头后面不会有记录，当作没有日志
+    JournalHeader header;
+    if (fread(&header, 1, sizeof(header), fp) != sizeof(header)) {
+        fclose(fp);
+        return 0;
+    }
+    if (memcmp(header.magic, journal_magic, sizeof(journal_magic)) != 0 || header.record_size != record_size) {
+        LOG_ERROR << "journal : bad header " << path << ", move it aside to start from the snapshot only";
+        fclose(fp);
+        return -1;
+    }
+    valid_size = sizeof(header);
+
+    vector<uint8_t> entry(sizeof(uint32_t) + record_size);
+    uint64_t count = 0;
+    while (fread(entry.data(), entry.size(), 1, fp) == 1) {
+        uint32_t sum;
+        memcpy(&sum, entry.data(), sizeof(sum));
+        if (sum != checksum(entry.data() + sizeof(sum), record_size)) break;
+        replay(entry.data() + sizeof(sum));
+        valid_size += entry.size();
+        count ++;
+    }
+    LOG_INFO << "journal : replayed " << count << " records from " << path;
+    fclose(fp);
+    return 0;
+}
+
+int Journal::Open(function<void(const uint8_t*)> replay)
+{
+    // 文件头不对时不能新建日志把它覆盖掉，否则快照之后的修改全部丢失
+    uint64_t valid_size;
+    if (Replay(old_path, replay, valid_size) == -1) return -1;
+    if (Replay(path, replay, valid_size) == -1) return -1;
+    if (valid_size == 0) return Create();
+
+    fd = open(path.c_str(), O_WRONLY);
+    if (fd == -1 || ftruncate(fd, valid_size) == -1 || lseek(fd, valid_size, SEEK_SET) == -1) {
+        LOG_ERROR << "journal : open " << path << " " << strerror(errno);
+        return -1;
+    }
+    size = valid_size;
+    return 0;
+}
+
+int Journal::Create()
+{
+    if (fd != -1) close(fd);
+    fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, journal_magic, sizeof(journal_magic));
+    header.record_size = record_size;
+    if (fd == -1 || write_full(fd, (uint8_t*)&header, sizeof(header)) == -1) {
+        LOG_ERROR << "journal : create " << path << " " << strerror(errno);
+        return -1;
+    }
+    size = sizeof(header);
+    return 0;
+}
+
+void Journal::Append(const vector<const void*>& records, bool durable)
+{
+    unique_lock<mutex> guard(lock);
+    pending_durable = pending_durable || durable;
+    for(const void* record : records) {
+        auto it = pending_index.find(record);
+        size_t pos;
+        if (it != pending_index.end()) {
+            pos = it->second;
+        } else {
+            pos = pending.size();
+            pending.resize(pos + sizeof(uint32_t) + record_size);
+            pending_index[record] = pos;
+        }
+        uint32_t sum = checksum((const uint8_t*)record, record_size);
+        memcpy(pending.data() + pos, &sum, sizeof(sum));
+        memcpy(pending.data() + pos + sizeof(sum), record, record_size);
+    }
+    uint64_t seq = ++ queued;
+
+    // 第一个发现没有人在写的线程负责写入当时所有等待的记录，其它线程等它完成
+    while (committed < seq) {
+        if (writing) {
+            cv.wait(guard);
+            continue;
+        }
+        writing = true;
+        vector<uint8_t> batch;
+        batch.swap(pending);
+        pending_index.clear();
+        bool batch_durable = pending_durable;
+        pending_durable = false;
+        uint64_t batch_seq = queued;
+        guard.unlock();
+
+        if (fd != -1) {
+            if (write_full(fd, batch.data(), batch.size()) == -1) {
+                LOG_ERROR << "journal : write " << path << " " << strerror(errno);
+            } else {
+                size += batch.size();
+                if (batch_durable && fdatasync(fd) == -1) {
+                    LOG_ERROR << "journal : fdatasync " << path << " " << strerror(errno);
+                }
+            }
+        }
+
+        guard.lock();
+        writing = false;
+        committed = batch_seq;
+        cv.notify_all();
+    }
+}
+
+uint64_t Journal::Size()
+{
+    lock_guard<mutex> guard(lock);
+    return size;
+}
+
+void Journal::Rotate(function<void()> snapshot)
+{
+    unique_lock<mutex> guard(lock);
+    cv.wait(guard, [&]() { return !writing; });
+    snapshot();
+
+    struct stat st;
+    if (fd == -1 || stat(old_path.c_str(), &st) == 0) return;
+    if (rename(path.c_str(), old_path.c_str()) == -1) {
+        LOG_ERROR << "journal : rename " << path << " " << strerror(errno);
+        return;
+    }
+    Create();
+}
+
+void Journal::DropOld()
+{
+    unlink(old_path.c_str());
+}
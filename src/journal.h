@@ -0,0 +1,60 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// 只追加的定长记录日志，用于保存元数据的修改，定期压缩进快照
+// 文件以JournalHeader开头，之后每条记录前有校验和，末尾写了一半的记录在打开时被截掉
+// 压缩时当前日志改名为path.old，之后的修改写入新的path；快照写好之后删除path.old
+// 所以重放的顺序是：快照、path.old、path
+class Journal
+{
+public:
+    Journal(const string& path, uint32_t record_size);
+    ~Journal();
+
+    // 重放path.old和path中的有效记录，然后打开path准备追加
+    // 文件头不对(比如record_size和这个版本不同)时不重放也不覆盖，返回-1
+    int Open(function<void(const uint8_t*)> replay);
+
+    // 追加一组记录，返回时已经写入；多个线程同时追加时由一个线程合并成一次write
+    // 以记录的地址作为标识，同一批中相同地址的记录只写最后的内容
+    // durable为true时返回前还fdatasync过，同一批中有一个需要时整批一起fdatasync
+    void Append(const vector<const void*>& records, bool durable = false);
+
+    uint64_t Size(); // 当前日志的字节数
+
+    // 压缩的第一步：等待正在进行的写入，持有锁调用snapshot复制出所有记录，然后换一个新的日志
+    // 上次的path.old还在(快照没有写成功)时不换，之后的快照仍然包含所有修改
+    void Rotate(function<void()> snapshot);
+    void DropOld(); // 压缩的最后一步：快照已经写好，删除path.old
+
+private:
+    // 文件头不对时返回-1；文件不存在或者不到一个文件头时valid_size为0
+    int Replay(const string& path, function<void(const uint8_t*)> replay, uint64_t& valid_size);
+    int Create(); // 新建只有文件头的日志
+
+private:
+    string path, old_path;
+    uint32_t record_size;
+    int fd;
+    uint64_t size;
+
+    mutex lock;
+    condition_variable cv;
+    bool writing; // 有线程正在写入或者压缩
+    uint64_t queued, committed; // 加入pending的批次序号、已经写入的批次序号
+    vector<uint8_t> pending; // 编码好的记录
+    bool pending_durable; // pending中有需要fdatasync的记录
+    unordered_map<const void*, size_t> pending_index; // 记录地址 -> 在pending中的位置
+};
+
+#endif // _JOURNAL_H_
@@ -0,0 +1,774 @@
+#define FUSE_USE_VERSION 31
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <plog/Log.h>
+
+#include "lowlevel.h"
+#include "options.h"
+
+using namespace std;
+
+// 重命名或者找到文件记录时整个换掉，建立之后不再修改
+struct NodeName
+{
+	string path; // 挂载点中的路径，传给FileControl
+	string real; // 真实文件夹中的路径
+	size_t hash; // PathHash()(path)
+	int key_index; // 所属的密钥，根目录为-1
+	File* file; // 文件记录，目录以及还没有记录的文件为NULL，找到之后不再改变(见FindFile)
+};
+
+struct Node
+{
+	// 操作时用atomic_load复制指针，之后不加锁使用，修改时用atomic_store或者atomic_compare_exchange
+	shared_ptr<const NodeName> name;
+	bool top_level; // 一级目录(密钥对应的文件夹)，不能删除、移动和打开
+	FileHandle handle; // 上次用的缓存项，读写和getattr时直接用
+	uint64_t nlookup; // 内核持有的引用数，减到0时删除，由nodes_mutex保护
+	bool detached; // 已经被删除或者被覆盖，不在paths中，由nodes_mutex保护
+};
+
+// 操作中使用的Node的内容
+struct NodeRef
+{
+	fuse_ino_t ino;
+	Node *node;
+	shared_ptr<const NodeName> name;
+
+	const char* path() const { return name->path.c_str(); }
+	const char* real() const { return name->real.c_str(); }
+	File* file() const { return name->file; }
+	bool top_level() const { return node->top_level; }
+	// 传给FileControl，指向name中的字符串，和这个NodeRef一起使用
+	FileRef file_ref() const
+	{
+		FileRef ref;
+		ref.real = real();
+		ref.hash = name->hash;
+		ref.file = name->file;
+		ref.handle = &node->handle;
+		return ref;
+	}
+};
+
+struct DirHandle
+{
+	vector<pair<string, struct stat>> entries; // opendir时读出全部目录项
+};
+
+
+static FileControl *control = NULL;
+static struct fuse_session *session = NULL;
+static set<string> key_names; // 根目录下只有这些目录可以访问
+
+static mutex nodes_mutex; // 保护paths和所有Node的nlookup、detached，每次操作读Node时不需要
+static unordered_map<string, Node*> paths; // 路径 -> 内核查找过的Node，不含根目录
+static Node root;
+
+static Node *get_node(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? &root : (Node*)ino;
+}
+
+static shared_ptr<const NodeName> make_name(const string &path, File *file)
+{
+	shared_ptr<NodeName> name = make_shared<NodeName>();
+	name->path = path;
+	name->real = control->Resolve(path);
+	name->hash = PathHash()(name->path.c_str());
+	name->key_index = path == "/" ? -1 : control->KeyIndex(name->path.c_str());
+	name->file = file;
+	return name;
+}
+
+static NodeRef get_ref(fuse_ino_t ino)
+{
+	NodeRef ref;
+	ref.ino = ino;
+	ref.node = get_node(ino);
+	ref.name = atomic_load(&ref.node->name);
+	if (ref.name->file == NULL && ino != FUSE_ROOT_ID) {
+		// 其它节点新建的文件在查找之后才有记录，第一次用到时再找；期间被重命名了就不换
+		File *file = control->FindFile(ref.path());
+		if (file != NULL) {
+			shared_ptr<NodeName> found = make_shared<NodeName>(*ref.name);
+			found->file = file;
+			shared_ptr<const NodeName> expected = ref.name;
+			atomic_compare_exchange_strong(&ref.node->name, &expected, shared_ptr<const NodeName>(found));
+			ref.name = found;
+		}
+	}
+	return ref;
+}
+
+static string child_path(const NodeRef &parent, const char *name)
+{
+	string path = parent.ino == FUSE_ROOT_ID ? "" : parent.name->path;
+	path += "/";
+	path += name;
+	return path;
+}
+
+// 返回的Node的引用数已经加1
+static Node *insert_node(const string &path, bool top_level)
+{
+	{
+		lock_guard<mutex> guard(nodes_mutex);
+		auto it = paths.find(path);
+		if (it != paths.end()) {
+			it->second->nlookup ++;
+			return it->second;
+		}
+	}
+
+	shared_ptr<const NodeName> name = make_name(path, control->FindFile(path.c_str()));
+
+	lock_guard<mutex> guard(nodes_mutex);
+	auto it = paths.find(path);
+	if (it != paths.end()) { // 期间被其它线程插入了
+		it->second->nlookup ++;
+		return it->second;
+	}
+	Node *node = new Node;
+	node->name = name;
+	node->top_level = top_level;
+	node->handle.file = NULL;
+	node->nlookup = 1;
+	node->detached = false;
+	paths[path] = node;
+	return node;
+}
+
+static void detach_node(const string &path)
+{
+	lock_guard<mutex> guard(nodes_mutex);
+	auto it = paths.find(path);
+	if (it == paths.end()) return;
+	it->second->detached = true;
+	paths.erase(it);
+}
+
+static void forget_node(fuse_ino_t ino, uint64_t nlookup)
+{
+	if (ino == FUSE_ROOT_ID) return;
+	Node *node = get_node(ino);
+	lock_guard<mutex> guard(nodes_mutex);
+	node->nlookup -= min(node->nlookup, nlookup);
+	if (node->nlookup > 0) return;
+	if (!node->detached) paths.erase(atomic_load(&node->name)->path);
+	delete node;
+}
+
+// 长度和修改时间取缓存和文件记录中的值，不写回
+static int stat_ref(const NodeRef &ref, struct stat *st)
+{
+	FileRef file = ref.file_ref();
+	if (control->Stat(ref.path(), st, &file) == -1)
+		return errno;
+	st->st_ino = ref.ino;
+	return 0;
+}
+
+// 新建或者找到parent下的name之后回复，create为NULL时用fuse_reply_entry
+static void reply_entry(fuse_req_t req, const NodeRef &parent, const char *name, struct fuse_file_info *create)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = options.attr_timeout;
+	e.entry_timeout = options.attr_timeout;
+
+	string path = child_path(parent, name);
+	if (control->Stat(path.c_str(), &e.attr) == -1) {
+		int err = errno;
+		if (err == ENOENT && create == NULL && options.attr_timeout > 0) {
+			fuse_reply_entry(req, &e); // ino为0，内核缓存这个不存在的目录项，其它节点新建时会通知
+			return;
+		}
+		if (create != NULL) close(create->fh);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	Node *node = insert_node(path, parent.ino == FUSE_ROOT_ID);
+	e.ino = (fuse_ino_t)node;
+	e.attr.st_ino = e.ino;
+
+	if (create != NULL)
+		fuse_reply_create(req, &e, create);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+// 收到其它节点的修改或删除之后，让这个文件、它所在的目录以及目录中这一项的缓存失效
+// 不在锁内通知，内核处理通知时可能要等正在进行的查找完成
+static void invalidate_remote(const char *path)
+{
+	string parent = control->Pathname(path);
+	const char *name = path + parent.length() + 1;
+	fuse_ino_t ino = 0, parent_ino = 0;
+	{
+		lock_guard<mutex> guard(nodes_mutex);
+		auto it = paths.find(path);
+		if (it != paths.end()) ino = (fuse_ino_t)it->second;
+		it = paths.find(parent);
+		if (parent.empty()) parent_ino = FUSE_ROOT_ID;
+		else if (it != paths.end()) parent_ino = (fuse_ino_t)it->second;
+	}
+	if (ino) fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+	if (parent_ino) {
+		fuse_lowlevel_notify_inval_inode(session, parent_ino, 0, 0);
+		fuse_lowlevel_notify_inval_entry(session, parent_ino, name, strlen(name));
+	}
+}
+
+static int result_errno(int res)
+{
+	return res == -1 ? errno : -res; // FileControl有的函数失败时直接返回-errno
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	LOG_INFO << "ll_init";
+	(void) userdata;
+	(void) conn;
+
+	if (options.attr_timeout > 0)
+		control->SetChangeHandler(invalidate_remote);
+	control->Init();
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	LOG_INFO << "ll_lookup: " << name;
+	if (parent == FUSE_ROOT_ID && key_names.find(name) == key_names.end()) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	reply_entry(req, get_ref(parent), name, NULL);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	forget_node(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		forget_node(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	(void) fi;
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_getattr: " << ref.path();
+
+	struct stat st;
+	int err = stat_ref(ref, &st);
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+		       int to_set, struct fuse_file_info *fi)
+{
+	(void) fi;
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_setattr: " << ref.path();
+	int res;
+
+	if ((to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_SIZE)) &&
+	    (ref.top_level() || ino == FUSE_ROOT_ID)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		control->Sync(ref.path());
+		res = chmod(ref.real(), attr->st_mode);
+		if (res == -1)
+			goto out_err;
+	}
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+		control->Sync(ref.path());
+		res = lchown(ref.real(), uid, gid);
+		if (res == -1)
+			goto out_err;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		FileRef file = ref.file_ref();
+		res = control->TruncateFile(ref.path(), attr->st_size, &file);
+		if (res < 0) {
+			fuse_reply_err(req, result_errno(res));
+			return;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+		tv[0].tv_sec = tv[1].tv_sec = 0;
+		tv[0].tv_nsec = tv[1].tv_nsec = UTIME_OMIT;
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+		control->Sync(ref.path());
+		/* don't use utime/utimes since they follow symlinks */
+		res = utimensat(AT_FDCWD, ref.real(), tv, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			goto out_err;
+	}
+
+	ll_getattr(req, ino, fi);
+	return;
+
+out_err:
+	fuse_reply_err(req, errno);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_access: " << ref.path();
+
+	fuse_reply_err(req, access(ref.real(), mask) == -1 ? errno : 0);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	(void) ino;
+	fuse_reply_err(req, EACCES);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_opendir: " << ref.path();
+	DirHandle *d = new DirHandle;
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFDIR;
+
+	d->entries.push_back(make_pair(".", st));
+	d->entries.push_back(make_pair("..", st));
+	if (ino == FUSE_ROOT_ID) {
+		for (const string &name : key_names)
+			d->entries.push_back(make_pair(name, st));
+	} else {
+		DIR *dp = opendir(ref.real());
+		if (dp == NULL) {
+			delete d;
+			fuse_reply_err(req, errno);
+			return;
+		}
+		struct dirent *de;
+		while ((de = readdir(dp)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			memset(&st, 0, sizeof(st));
+			st.st_ino = de->d_ino;
+			st.st_mode = de->d_type << 12;
+			d->entries.push_back(make_pair(de->d_name, st));
+		}
+		closedir(dp);
+	}
+
+	fi->fh = (uint64_t)d;
+	fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	(void) ino;
+	DirHandle *d = (DirHandle*)fi->fh;
+	vector<char> buf(size);
+	size_t pos = 0;
+
+	for (size_t i = offset; i < d->entries.size(); i++) {
+		size_t len = fuse_add_direntry(req, buf.data() + pos, size - pos,
+					       d->entries[i].first.c_str(),
+					       &d->entries[i].second, i + 1);
+		if (len > size - pos)
+			break;
+		pos += len;
+	}
+	fuse_reply_buf(req, buf.data(), pos);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	(void) ino;
+	delete (DirHandle*)fi->fh;
+	fuse_reply_err(req, 0);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		     mode_t mode, dev_t rdev)
+{
+	LOG_INFO << "ll_mknod: " << name;
+	if (parent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	NodeRef dir = get_ref(parent);
+	string real = control->Resolve(child_path(dir, name));
+	int res;
+
+	if (S_ISREG(mode)) {
+		res = open(real.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (res >= 0)
+			res = close(res);
+	} else if (S_ISFIFO(mode))
+		res = mkfifo(real.c_str(), mode);
+	else
+		res = mknod(real.c_str(), mode, rdev);
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	reply_entry(req, dir, name, NULL);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+		     mode_t mode)
+{
+	LOG_INFO << "ll_mkdir: " << name;
+	if (parent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	NodeRef dir = get_ref(parent);
+	if (mkdir(control->Resolve(child_path(dir, name)).c_str(), mode) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	reply_entry(req, dir, name, NULL);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	LOG_INFO << "ll_unlink: " << name;
+	if (parent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	string path = child_path(get_ref(parent), name);
+
+	control->Sync(path.c_str());
+	control->ClearCache(path.c_str());
+	if (control->FindFile(path.c_str()) == NULL) { // 不是通过ShareDisk建立的文件
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	int res = control->DeleteFile(path.c_str());
+	if (res < 0) {
+		fuse_reply_err(req, result_errno(res));
+		return;
+	}
+	detach_node(path);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	LOG_INFO << "ll_rmdir: " << name;
+	if (parent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	string path = child_path(get_ref(parent), name);
+
+	control->SyncDir(path.c_str());
+	if (rmdir(control->Resolve(path).c_str()) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	detach_node(path);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+		       const char *name)
+{
+	(void) link;
+	(void) parent;
+	(void) name;
+	fuse_reply_err(req, EACCES);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      fuse_ino_t newparent, const char *newname,
+		      unsigned int flags)
+{
+	LOG_INFO << "ll_rename: " << name << " " << newname;
+	if (parent == FUSE_ROOT_ID || newparent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	string from = child_path(get_ref(parent), name);
+	string to = child_path(get_ref(newparent), newname);
+
+	int res = control->RenameFile(from.c_str(), to.c_str());
+	if (res < 0) {
+		fuse_reply_err(req, result_errno(res));
+		return;
+	}
+
+	// 原来的Node移到新的路径，被覆盖的Node不再对应任何路径
+	shared_ptr<const NodeName> renamed = make_name(to, control->FindFile(to.c_str()));
+	detach_node(to);
+	{
+		lock_guard<mutex> guard(nodes_mutex);
+		auto it = paths.find(from);
+		if (it != paths.end()) {
+			Node *node = it->second;
+			paths.erase(it);
+			atomic_store(&node->name, renamed);
+			paths[to] = node;
+		}
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		    const char *newname)
+{
+	(void) ino;
+	(void) newparent;
+	(void) newname;
+	fuse_reply_err(req, EACCES);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, struct fuse_file_info *fi)
+{
+	LOG_INFO << "ll_create: " << name;
+	if (parent == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	NodeRef dir = get_ref(parent);
+	string path = child_path(dir, name);
+
+	control->Sync(path.c_str());
+	int res = control->NewFile(path.c_str(), fi->flags, mode);
+	if (res < 0) {
+		fuse_reply_err(req, result_errno(res));
+		return;
+	}
+	fi->fh = res;
+	reply_entry(req, dir, name, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_open: " << ref.path();
+	int res;
+
+	if (ref.top_level() || ino == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	control->Sync(ref.path());
+	/* The block map has to be truncated together with the data,
+	   and only once open() has succeeded */
+	res = open(ref.real(), fi->flags & ~O_TRUNC);
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	if (fi->flags & O_TRUNC) {
+		FileRef file = ref.file_ref();
+		int trunc = control->TruncateFile(ref.path(), 0, &file);
+		if (trunc < 0) {
+			int err = result_errno(trunc);
+			close(res);
+			fuse_reply_err(req, err);
+			return;
+		}
+	}
+
+	fi->fh = res;
+	fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_read: " << ref.path();
+	static thread_local vector<char> buf; // 每个线程一个，不用每次分配
+
+	if (buf.size() < size)
+		buf.resize(size);
+	FileRef file = ref.file_ref();
+	int res = control->ReadFile(ref.path(), fi->fh, buf.data(), size, offset, &file);
+	if (res < 0)
+		fuse_reply_err(req, result_errno(res));
+	else
+		fuse_reply_buf(req, buf.data(), res);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		     size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_write: " << ref.path();
+
+	FileRef file = ref.file_ref();
+	int res = control->WriteFile(ref.path(), fi->fh, buf, size, offset, &file);
+	if (res < 0)
+		fuse_reply_err(req, result_errno(res));
+	else
+		fuse_reply_write(req, res);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_statfs: " << ref.path();
+	struct statvfs st;
+
+	if (statvfs(ref.real(), &st) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_release: " << ref.path();
+	control->Sync(ref.path());
+	close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+		     struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
+	NodeRef ref = get_ref(ino);
+	LOG_INFO << "ll_fsync: " << ref.path();
+	control->Sync(ref.path());
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops ll_oper;
+
+static void bind_ll()
+{
+	ll_oper.init		= ll_init;
+	ll_oper.lookup		= ll_lookup;
+	ll_oper.forget		= ll_forget;
+	ll_oper.forget_multi	= ll_forget_multi;
+	ll_oper.getattr		= ll_getattr;
+	ll_oper.setattr		= ll_setattr;
+	ll_oper.access		= ll_access;
+	ll_oper.readlink	= ll_readlink;
+	ll_oper.opendir		= ll_opendir;
+	ll_oper.readdir		= ll_readdir;
+	ll_oper.releasedir	= ll_releasedir;
+	ll_oper.mknod		= ll_mknod;
+	ll_oper.mkdir		= ll_mkdir;
+	ll_oper.unlink		= ll_unlink;
+	ll_oper.rmdir		= ll_rmdir;
+	ll_oper.symlink		= ll_symlink;
+	ll_oper.rename		= ll_rename;
+	ll_oper.link		= ll_link;
+	ll_oper.create		= ll_create;
+	ll_oper.open		= ll_open;
+	ll_oper.read		= ll_read;
+	ll_oper.write		= ll_write;
+	ll_oper.statfs		= ll_statfs;
+	ll_oper.release		= ll_release;
+	ll_oper.fsync		= ll_fsync;
+}
+
+int lowlevel_main(int argc, char *argv[], FileControl *fc)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	int ret = 1;
+
+	control = fc;
+	for (const string &name : control->KeyNames())
+		key_names.insert(name);
+	root.name = make_name("/", NULL);
+	root.top_level = true;
+	root.handle.file = NULL;
+	root.nlookup = 1;
+	root.detached = false;
+	bind_ll();
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if (opts.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s mountpoint\n", argv[0]);
+		goto err_out1;
+	}
+
+	session = fuse_session_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+	if (session == NULL)
+		goto err_out1;
+	if (fuse_set_signal_handlers(session) != 0)
+		goto err_out2;
+	if (fuse_session_mount(session, opts.mountpoint) != 0)
+		goto err_out3;
+
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread)
+		ret = fuse_session_loop(session);
+	else
+		ret = fuse_session_loop_mt(session, opts.clone_fd);
+
+	fuse_session_unmount(session);
+err_out3:
+	fuse_remove_signal_handlers(session);
+err_out2:
+	fuse_session_destroy(session);
+err_out1:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _LOWLEVEL_H_
+#define _LOWLEVEL_H_
+
+#include "file_control.h"
+
+// 用FUSE的low-level接口挂载，argv[1]为挂载点，参数的含义和fuse_main相同
+// 内核按inode访问文件，每个inode对应一个Node，保存它的路径、真实路径和文件记录，操作时不需要再解析路径
+// 每个节点保存解析好的路径、密钥、文件记录和上次用的缓存项(FileRef)，读写和getattr时传给FileControl，不用按路径查找
+int lowlevel_main(int argc, char *argv[], FileControl *control);
+
+#endif // _LOWLEVEL_H_
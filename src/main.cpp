@@ -50,12 +50,28 @@
 #endif
 
 #include "file_control.h"
+#include "aes.h"
+#include "aes_parallel.h"
+#include "aes_gcm.h"
+#include "options.h"
+#include "lowlevel.h"
 #include <vector>
 #include <plog/Log.h>
 #include <plog/Appenders/ConsoleAppender.h>
 
 FileControl* control = NULL;
 
+/* Called from the receive thread after a file was modified or
+   deleted by another node: drop the kernel's cached attributes and
+   dentry of the file, and of its directory whose listing and mtime
+   may have changed. Nodes the kernel never looked up are skipped. */
+static void invalidate_remote(struct fuse *fuse, const char *path)
+{
+	fuse_invalidate_path(fuse, path);
+	string parent = control->Pathname(path);
+	fuse_invalidate_path(fuse, parent.empty() ? "/" : parent.c_str());
+}
+
 static void *xmp_init(struct fuse_conn_info *conn,
 		      struct fuse_config *cfg)
 {
@@ -63,17 +79,22 @@ static void *xmp_init(struct fuse_conn_info *conn,
 	(void) conn;
 	cfg->use_ino = 1;
 
-	/* Pick up changes from lower filesystem right away. This is
-	   also necessary for better hardlink support. When the kernel
-	   calls the unlink() handler, it does not know the inode of
-	   the to-be-removed entry and can therefore not invalidate
-	   the cache of the associated inode - resulting in an
-	   incorrect st_nlink value being reported for any remaining
-	   hardlinks to this inode. */
-	cfg->entry_timeout = 0;
-	cfg->attr_timeout = 0;
+	/* Hard links are not supported, so an unlink never leaves a
+	   stale st_nlink behind. Local changes go through the kernel,
+	   which drops what it cached itself; changes received from
+	   other nodes are invalidated path by path in
+	   invalidate_remote. Negative entries are not cached because
+	   a file created remotely has no node to invalidate. */
+	cfg->entry_timeout = options.attr_timeout;
+	cfg->attr_timeout = options.attr_timeout;
 	cfg->negative_timeout = 0;
 
+	if (options.attr_timeout > 0) {
+		struct fuse *fuse = fuse_get_context()->fuse;
+		control->SetChangeHandler([fuse](const char *path) {
+			invalidate_remote(fuse, path);
+		});
+	}
 	control->Init();
 
 	return NULL;
@@ -86,12 +107,12 @@ static int xmp_getattr(const char *path, struct stat *stbuf,
 	(void) fi;
 	int res;
 
-	control->Sync(path);
-	res = lstat(control->Resolve(path).c_str(), stbuf);
+	/* Size and mtime come from the cache and the file record, so a
+	   stat on a file being written doesn't flush and broadcast it */
+	res = control->Stat(path, stbuf);
 	LOG_INFO << "xmp_getattr end: " << path;
 	if (res == -1)
 		return -errno;
-	if (control->FindFile(path)) stbuf->st_mtime = control->FindFile(path)->timestamp;
 
 	return 0;
 }
@@ -104,7 +125,6 @@ static int xmp_access(const char *path, int mask)
 	if (!control->IsAccessible(path))
 		return -EACCES;
 
-	control->Sync(path);
 	res = access(control->Resolve(path).c_str(), mask);
 	if (res == -1)
 		return -errno;
@@ -156,7 +176,6 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		return 0;
 	}
 
-	control->SyncDir(path);
 	dp = opendir(control->Resolve(path).c_str());
 	if (dp == NULL)
 		return -errno;
@@ -293,10 +312,6 @@ static int xmp_rename(const char *from, const char *to, unsigned int flags)
 	if (flags)
 		return -EINVAL;
 
-	control->Sync(from);
-	control->ClearCache(from);
-	control->Sync(to);
-	control->ClearCache(to);
 	res = control->RenameFile(from, to);
 	if (res == -1)
 		return -errno;
@@ -376,30 +391,19 @@ static int xmp_truncate(const char *path, off_t size,
 			struct fuse_file_info *fi)
 {
 	LOG_INFO << "xmp_truncate";
-	return -EACCES;
-/*
 	int res;
 
+	(void) fi;
 	if (!control->IsAccessible(path))
 		return -EACCES;
 	if (control->IsTopLevel(path))
 		return -EACCES;
-	char *tmp;
-	int len_path = strlen(path);
-	int len_pd = strlen(pd);
-	tmp = (char *)malloc(len_pd + len_path + 1);
-	getnewpath(tmp, path, pd);
 
-	control->TouchFile(path);
-	if (fi != NULL)
-		res = ftruncate(fi->fh, size);
-	else
-		res = truncate(tmp, size);
+	res = control->TruncateFile(path, size);
 	if (res == -1)
 		return -errno;
 
 	return 0;
-*/
 }
 
 #ifdef HAVE_UTIMENSAT
@@ -451,9 +455,18 @@ static int xmp_open(const char *path, struct fuse_file_info *fi)
 		return -EACCES;
 
 	control->Sync(path);
-	res = open(control->Resolve(path).c_str(), fi->flags);
+	/* The block map has to be truncated together with the data,
+	   and only once open() has succeeded */
+	res = open(control->Resolve(path).c_str(), fi->flags & ~O_TRUNC);
 	if (res == -1)
 		return -errno;
+	if (fi->flags & O_TRUNC) {
+		if (control->TruncateFile(path, 0) == -1) {
+			int err = errno;
+			close(res);
+			return -err;
+		}
+	}
 
 	fi->fh = res;
 	return 0;
@@ -527,7 +540,6 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 	LOG_INFO << "xmp_statfs";
 	int res;
 
-	control->Sync(path);
 	res = statvfs(control->Resolve(path).c_str(), stbuf);
 	if (res == -1)
 		return -errno;
@@ -598,7 +610,6 @@ static int xmp_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
 	LOG_INFO << "xmp_setxattr";
-	control->Sync(path);
 	int res = lsetxattr(control->Resolve(path).c_str(), name, value, size, flags);
 	if (res == -1)
 		return -errno;
@@ -609,7 +620,6 @@ static int xmp_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
 	LOG_INFO << "xmp_getxattr";
-	control->Sync(path);
 	int res = lgetxattr(control->Resolve(path).c_str(), name, value, size);
 	if (res == -1)
 		return -errno;
@@ -619,7 +629,6 @@ static int xmp_getxattr(const char *path, const char *name, char *value,
 static int xmp_listxattr(const char *path, char *list, size_t size)
 {
 	LOG_INFO << "xmp_listxattr";
-	control->Sync(path);
 	int res = llistxattr(control->Resolve(path).c_str(), list, size);
 	if (res == -1)
 		return -errno;
@@ -629,7 +638,6 @@ static int xmp_listxattr(const char *path, char *list, size_t size)
 static int xmp_removexattr(const char *path, const char *name)
 {
 	LOG_INFO << "xmp_removexattr";
-	control->Sync(path);
 	int res = lremovexattr(control->Resolve(path).c_str(), name);
 	if (res == -1)
 		return -errno;
@@ -711,18 +719,46 @@ int main(int argc, char *argv[])
 			name1:key1
 			name1:key2
 			......
+		参数中以--开头的是可选参数(见options.h)，例如 --crypto-workers=4
 	*/
 	static plog::MyAppender<plog::TxtFormatter> consoleAppender;
     plog::init(plog::debug, &consoleAppender);
 
+	if (!aes_self_test()) {
+		LOG_ERROR << "aes_self_test failed";
+		return 1;
+	}
+	if (!aes_gcm_self_test()) {
+		LOG_ERROR << "aes_gcm_self_test failed";
+		return 1;
+	}
+
 	vector<string> keys;
 
-	for (int i = 3; i < argc; i++)
-		keys.push_back(argv[i]);
+	for (int i = 3; i < argc; i++) {
+		string arg = argv[i];
+		if (arg.compare(0, 2, "--") == 0) {
+			if (!ParseOption(arg)) {
+				fprintf(stderr, "unknown option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			keys.push_back(arg);
+		}
+	}
+
+	if (!aes_select_backend(options.aes_backend.c_str())) {
+		fprintf(stderr, "aes backend not supported on this cpu: %s\n", options.aes_backend.c_str());
+		return 1;
+	}
+	LOG_INFO << "aes backend: " << aes_backend_name();
+	aes_set_parallel_workers(options.crypto_workers);
 
 	control = new FileControl(argv[2], keys);
 
 	// umask(0);
+	if (options.fuse_api == "low")
+		return lowlevel_main(2, argv, control);
 	bind();
 	return fuse_main(2, argv, &xmp_oper, NULL);
 }
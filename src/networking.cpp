@@ -7,12 +7,27 @@
 #include <cassert>
 #include <ctime>
 
-Networking::Networking(const vector<SecretKey>& keys)
+// 派生key_id时加密的明文，和GCM的H = E(K, 0)区分开
+static const uint8_t key_id_label[16] = "ShareDisk keyid";
+
+Networking::Networking(const vector<AesKey>& keys, int wire_version, bool accept_v1)
 {
-    this->keys = keys;
+    for(int i = 0; i < (int)keys.size(); i ++)
+    {
+        NetKey key;
+        aes_gcm_init(keys[i], &key.gcm);
+        uint8_t encrypted[16];
+        aes_encode(keys[i], key_id_label, sizeof(key_id_label), encrypted);
+        memcpy(&key.key_id, encrypted, sizeof(key.key_id));
+        this->key_index.insert(make_pair(key.key_id, i));
+        this->keys.push_back(key);
+    }
+    this->wire_version = wire_version;
+    this->accept_v1 = accept_v1;
     this->listen_fd = -1;
 
     assert(sizeof(MessageHead) % 16 == 0);
+    assert(wire_version == 1 || wire_version == 2);
 }
 
 bool Networking::Listen()
@@ -59,18 +74,16 @@ bool Networking::Listen()
     return true;
 }
 
-data_t Networking::Recv()
+Slice Networking::Recv()
 {
-    data_t packet_data = CreateData();
+    // 只解码收到的count字节，不需要清零
+    data_t packet_data = CreateBuffer(1<<16);
     socklen_t len;
     int count;
     struct sockaddr_in remote_addr; //remote_addr用于记录发送方的地址信息
 
-    packet_data->resize(1<<16);
-
     while(1)
     {
-        memset(packet_data->data(), 0, packet_data->size());
         len = sizeof(remote_addr);
         count = recvfrom(listen_fd, packet_data->data(), packet_data->size(), 0, (struct sockaddr*)&remote_addr, &len);  //recvfrom是拥塞函数，没有数据就一直拥塞
         if(count == -1)
@@ -79,75 +92,178 @@ data_t Networking::Recv()
             continue;
         }
 
-        // message check
-        if (count < sizeof(MessageHead)*2)
-        {
-            LOG_ERROR << "Message Too Small";
-            continue;
+        Slice ret;
+        uint32_t version = count >= (int)sizeof(uint32_t) ? ntohl(*(const uint32_t*)packet_data->data()) : 0;
+        if (version == 2 && count >= (int)(sizeof(MessageHeadV2)+AES_GCM_TAG_SIZE)) {
+            uint8_t* payload = packet_data->data()+sizeof(MessageHeadV2);
+            pair<KeyIter, KeyIter> range;
+            if (!CheckHeadV2(packet_data->data(), count, range)) continue;
+            if (!DecodeV2(packet_data->data(), range, payload)) continue;
+            ret = Slice(packet_data, sizeof(MessageHeadV2), count-sizeof(MessageHeadV2)-AES_GCM_TAG_SIZE);
+        } else {
+            data_t data;
+            if (!Decode(packet_data->data(), count, data)) continue;
+            ret = Slice(data);
         }
-        MessageHead head = *(MessageHead*)packet_data->data();
-        uint32_t payload_real_length;
-        uint32_t payload_total_length;
-        if (!CheckHead(head, payload_real_length, payload_total_length))
-        {
-            LOG_ERROR << "MessageHead Check Fail";
-            continue;
-        }
-        if (payload_total_length % 16 != 0) // AES data size % 16 == 0
-        {
-            LOG_ERROR << "payload_total_length % 16 = " << payload_total_length % 16 << " != 0";
-            continue;
-        }
-        if (count != sizeof(MessageHead)*2+payload_total_length)
-        {
-            LOG_ERROR << "payload_total_length = " << payload_total_length << " count = " << count;
-            continue;
-        }
-        int secret_key_index = -1;
-        for(int i = 0; i < (int)keys.size(); i ++)
+
+        LOG_INFO << "Recv a Packet From " << inet_ntoa(remote_addr.sin_addr) << ":" << ntohs(remote_addr.sin_port);
+
+        return ret;
+    }
+}
+
+bool Networking::Decode(const uint8_t* packet, size_t count, data_t& data)
+{
+    uint32_t version = count >= sizeof(uint32_t) ? ntohl(*(const uint32_t*)packet) : 0;
+    if (version == 1)
+    {
+        if (accept_v1) return DecodeV1(packet, count, data);
+        LOG_ERROR << "Message Version 1 Rejected";
+        return false;
+    }
+    if (version == 2)
+    {
+        if (count < sizeof(MessageHeadV2)+AES_GCM_TAG_SIZE)
         {
-            uint8_t* content = (uint8_t*)&head;
-            uint8_t encrypted[sizeof(MessageHead)];
-            aes_encode((uint8_t*)&keys[i], sizeof(SecretKey), content, sizeof(MessageHead), encrypted);
-            if (memcmp(packet_data->data()+sizeof(MessageHead), encrypted, sizeof(MessageHead)) == 0)
-            {
-                secret_key_index = i;
-                break;
-            }
+            LOG_ERROR << "Message Too Small";
+            return false;
         }
-        if (secret_key_index < 0)
+        pair<KeyIter, KeyIter> range;
+        if (!CheckHeadV2(packet, count, range)) return false;
+        data = CreateBuffer(count-sizeof(MessageHeadV2)-AES_GCM_TAG_SIZE);
+        return DecodeV2(packet, range, data->data());
+    }
+    LOG_ERROR << "Unknown Message Version " << version;
+    return false;
+}
+
+bool Networking::DecodeV1(const uint8_t* packet, size_t count, data_t& data)
+{
+    if (count < sizeof(MessageHead)*2)
+    {
+        LOG_ERROR << "Message Too Small";
+        return false;
+    }
+    MessageHead head = *(const MessageHead*)packet;
+    uint32_t payload_real_length;
+    uint32_t payload_total_length;
+    if (!CheckHead(head, payload_real_length, payload_total_length))
+    {
+        LOG_ERROR << "MessageHead Check Fail";
+        return false;
+    }
+    if (payload_total_length % 16 != 0) // AES data size % 16 == 0
+    {
+        LOG_ERROR << "payload_total_length % 16 = " << payload_total_length % 16 << " != 0";
+        return false;
+    }
+    if (payload_real_length > payload_total_length) // 缓冲不清零，resize变大会露出未初始化的内容
+    {
+        LOG_ERROR << "payload_real_length = " << payload_real_length << " > payload_total_length = " << payload_total_length;
+        return false;
+    }
+    if (count != sizeof(MessageHead)*2+payload_total_length)
+    {
+        LOG_ERROR << "payload_total_length = " << payload_total_length << " count = " << count;
+        return false;
+    }
+    int secret_key_index = -1;
+    for(int i = 0; i < (int)keys.size(); i ++)
+    {
+        uint8_t* content = (uint8_t*)&head;
+        uint8_t encrypted[sizeof(MessageHead)];
+        aes_encode(keys[i].gcm.aes, content, sizeof(MessageHead), encrypted);
+        if (memcmp(packet+sizeof(MessageHead), encrypted, sizeof(MessageHead)) == 0)
         {
-            LOG_ERROR << "Can Not Decode Data";
-            continue;
+            secret_key_index = i;
+            break;
         }
+    }
+    if (secret_key_index < 0)
+    {
+        LOG_ERROR << "Can Not Decode Data";
+        return false;
+    }
 
-        LOG_INFO << "Recv a Packet From " << inet_ntoa(remote_addr.sin_addr) << ":" << ntohs(remote_addr.sin_port);
-        
-        data_t data = CreateData();
-        data->resize(payload_total_length);
-        aes_decode((uint8_t*)&keys[secret_key_index], sizeof(SecretKey), packet_data->data()+sizeof(MessageHead)*2, payload_total_length, data->data());
-        data->resize(payload_real_length);
+    data = CreateBuffer(payload_total_length);
+    aes_decode(keys[secret_key_index].gcm.aes, packet+sizeof(MessageHead)*2, payload_total_length, data->data());
+    data->resize(payload_real_length);
+    return true;
+}
 
-        return data;
+bool Networking::CheckHeadV2(const uint8_t* packet, size_t count, pair<KeyIter, KeyIter>& range)
+{
+    const MessageHeadV2* head = (const MessageHeadV2*)packet;
+    if (!CheckTime(ntohl(head->time)))
+    {
+        LOG_ERROR << "MessageHead Check Fail";
+        return false;
+    }
+    const uint32_t payload_length = ntohl(head->payload_length);
+    if (count != sizeof(MessageHeadV2)+payload_length+AES_GCM_TAG_SIZE)
+    {
+        LOG_ERROR << "payload_length = " << payload_length << " count = " << count;
+        return false;
+    }
+
+    // 没有对应key_id的数据包不做任何解密就丢弃
+    range = key_index.equal_range(head->key_id);
+    if (range.first == range.second)
+    {
+        LOG_ERROR << "Unknown Key Id";
+        return false;
     }
+    return true;
 }
 
-void Networking::Broadcast(const SecretKey& key, data_t _data)
+bool Networking::DecodeV2(const uint8_t* packet, const pair<KeyIter, KeyIter>& range, uint8_t* out)
 {
-    data_t data = Clone(_data);
-    data_t packet_data = CreateData();
+    const MessageHeadV2* head = (const MessageHeadV2*)packet;
+    const uint32_t payload_length = ntohl(head->payload_length);
+    const uint8_t* payload = packet+sizeof(MessageHeadV2);
+    // 原地解密时认证失败会把密文清零，有多个候选的密钥时先解密到临时的缓冲
+    data_t attempt;
+    uint8_t* target = out;
+    if (out == payload && next(range.first) != range.second)
+    {
+        attempt = CreateBuffer(payload_length);
+        target = attempt->data();
+    }
+    for(auto it = range.first; it != range.second; it ++) // key_id只有32位，相同时以认证结果为准
+    {
+        if (aes_gcm_decrypt(keys[it->second].gcm, head->iv, packet, sizeof(MessageHeadV2),
+                            payload, payload_length, target, payload+payload_length))
+        {
+            if (target != out) memcpy(out, target, payload_length);
+            return true;
+        }
+    }
+    LOG_ERROR << "Can Not Decode Data";
+    return false;
+}
 
-    const uint32_t payload_real_length = data->size();
-    const uint32_t payload_total_length = (payload_real_length + 16 - 1) / 16 * 16;
-    const uint32_t size = sizeof(MessageHead)*2+payload_total_length;
-    data->resize(payload_total_length);
+void Networking::Broadcast(int key_index, data_t data)
+{
+    Send(Encode(key_index, data));
+}
 
-    packet_data->resize(size);
+void Networking::Broadcast(int key_index, const vector<Slice>& slices)
+{
+    Send(Encode(key_index, slices));
+}
 
-    MessageHead head = CreateHead(payload_real_length, payload_total_length);
-    *(MessageHead*)packet_data->data() = head;
-    aes_encode((uint8_t*)&key, sizeof(SecretKey), packet_data->data(), sizeof(MessageHead), packet_data->data()+sizeof(MessageHead));
-    aes_encode((uint8_t*)&key, sizeof(SecretKey), data->data(), payload_total_length, packet_data->data()+sizeof(MessageHead)*2);
+void Networking::SetSender(function<void(const data_t& packet)> sender)
+{
+    this->sender = sender;
+}
+
+void Networking::Send(const data_t& packet_data)
+{
+    if (sender) {
+        sender(packet_data);
+        return;
+    }
+    const uint32_t size = packet_data->size();
 
     for(int port = UDP_PORT_START; port <= UDP_PORT_END; port ++)
     {
@@ -163,6 +279,70 @@ void Networking::Broadcast(const SecretKey& key, data_t _data)
     }
 }
 
+data_t Networking::Encode(int key_index, data_t data)
+{
+    assert(key_index >= 0 && key_index < (int)keys.size());
+    if (wire_version == 1) return EncodeV1(key_index, data);
+    struct iovec piece = {data->data(), data->size()};
+    return EncodeV2(key_index, &piece, 1);
+}
+
+data_t Networking::Encode(int key_index, const vector<Slice>& slices)
+{
+    assert(key_index >= 0 && key_index < (int)keys.size());
+    if (wire_version == 1) return EncodeV1(key_index, Concat(slices)); // 旧格式需要补齐，先拼起来
+    vector<struct iovec> pieces(slices.size());
+    for(size_t i = 0; i < slices.size(); i ++) {
+        pieces[i].iov_base = (void*)slices[i].data();
+        pieces[i].iov_len = slices[i].size;
+    }
+    return EncodeV2(key_index, pieces.data(), pieces.size());
+}
+
+data_t Networking::EncodeV1(int key_index, data_t _data)
+{
+    const AesKey& key = keys[key_index].gcm.aes;
+    const uint32_t payload_real_length = _data->size();
+    const uint32_t payload_total_length = (payload_real_length + 16 - 1) / 16 * 16;
+    const uint32_t size = sizeof(MessageHead)*2+payload_total_length;
+    data_t data = CreateBuffer(payload_total_length);
+    memcpy(data->data(), _data->data(), payload_real_length);
+    memset(data->data()+payload_real_length, 0, payload_total_length-payload_real_length);
+
+    data_t packet_data = CreateBuffer(size);
+
+    MessageHead head = CreateHead(payload_real_length, payload_total_length);
+    *(MessageHead*)packet_data->data() = head;
+    aes_encode(key, packet_data->data(), sizeof(MessageHead), packet_data->data()+sizeof(MessageHead));
+    aes_encode(key, data->data(), payload_total_length, packet_data->data()+sizeof(MessageHead)*2);
+    return packet_data;
+}
+
+data_t Networking::EncodeV2(int key_index, const struct iovec* pieces, size_t count)
+{
+    uint32_t payload_length = 0;
+    for(size_t i = 0; i < count; i ++) payload_length += pieces[i].iov_len;
+    data_t packet_data = CreateBuffer(sizeof(MessageHeadV2)+payload_length+AES_GCM_TAG_SIZE);
+
+    uint8_t* packet = packet_data->data();
+    MessageHeadV2* head = (MessageHeadV2*)packet;
+    head->version = htonl(2);
+    head->time = htonl(time(0));
+    head->key_id = keys[key_index].key_id;
+    head->payload_length = htonl(payload_length);
+    RandomBytes(head->iv, sizeof(head->iv));
+
+    uint8_t* payload = packet+sizeof(MessageHeadV2);
+    if (count == 1) {
+        aes_gcm_encrypt(keys[key_index].gcm, head->iv, packet, sizeof(MessageHeadV2),
+                        (const uint8_t*)pieces[0].iov_base, payload_length, payload, payload+payload_length);
+    } else { // 加密的结果直接写在包头后面，一次sendto发出，不需要sendmsg拼接
+        aes_gcm_encrypt_gather(keys[key_index].gcm, head->iv, packet, sizeof(MessageHeadV2),
+                               pieces, count, payload, payload+payload_length);
+    }
+    return packet_data;
+}
+
 Networking::MessageHead Networking::CreateHead(uint32_t payload_real_length, uint32_t payload_total_length)
 {
     MessageHead head;
@@ -176,8 +356,13 @@ Networking::MessageHead Networking::CreateHead(uint32_t payload_real_length, uin
 bool Networking::CheckHead(const Networking::MessageHead& head, uint32_t& payload_real_length, uint32_t& payload_total_length)
 {
     if (ntohl(head.version) != 1) return false;
-    if (ntohl(head.time) < time(0) - 30 || time(0) + 30 < ntohl(head.time)) return false;
+    if (!CheckTime(ntohl(head.time))) return false;
     payload_real_length = ntohl(head.payload_real_length);
     payload_total_length = ntohl(head.payload_total_length);
     return true;
 }
+
+bool Networking::CheckTime(uint32_t t)
+{
+    return !(t < time(0) - 30 || time(0) + 30 < t);
+}
@@ -2,7 +2,11 @@
 #define _NETWORKING_H_
 
 #include "common.h"
+#include "aes.h"
+#include "aes_gcm.h"
 #include <vector>
+#include <unordered_map>
+#include <functional>
 
 using namespace std;
 
@@ -12,15 +16,24 @@ using namespace std;
 class Networking
 {
 public:
-    Networking(const vector<SecretKey>& keys);
+    // wire_version为发送时使用的格式；接收时总是支持版本2，accept_v1为false时丢弃版本1的数据包
+    Networking(const vector<AesKey>& keys, int wire_version, bool accept_v1 = true);
 
     bool Listen(); // 监听成功则返回true
 
-    data_t Recv(); // 接收一个数据包，已解密
+    Slice Recv(); // 接收一个数据包，已解密；版本2的包原地解密，返回的是包中的一段
 
-    void Broadcast(const SecretKey& key, data_t data); // 以密钥key广播数据
+    void Broadcast(int key_index, data_t data); // 以第key_index个密钥广播数据
+    void Broadcast(int key_index, const vector<Slice>& slices); // 内容为各段依次拼起来，加密时直接从各段读取，不先复制到一起
 
-private: // MessageHead|encrypted MessageHead|payload
+    // 设置之后打包好的数据包交给sender，不再发到网络上，比如bench中不需要真的广播；需要在开始广播之前设置
+    void SetSender(function<void(const data_t& packet)> sender);
+
+    data_t Encode(int key_index, data_t data); // 按wire_version打包并加密，不发送
+    data_t Encode(int key_index, const vector<Slice>& slices);
+    bool Decode(const uint8_t* packet, size_t count, data_t& data); // 校验并解密收到的数据包，失败返回false
+
+private: // 版本1: MessageHead|encrypted MessageHead|payload
     struct MessageHead
     {
         uint32_t version; // must be 1
@@ -31,9 +44,40 @@ private: // MessageHead|encrypted MessageHead|payload
     MessageHead CreateHead(uint32_t payload_real_length, uint32_t payload_total_length);
     bool CheckHead(const MessageHead& head, uint32_t& payload_real_length, uint32_t& payload_total_length);
 
+private: // 版本2: MessageHeadV2|AES-GCM加密的payload|tag，MessageHeadV2作为附加认证数据
+    struct MessageHeadV2
+    {
+        uint32_t version; // must be 2
+        uint32_t time;
+        uint32_t key_id; // 由密钥派生的标识，接收方据此直接找到密钥
+        uint32_t payload_length;
+        uint8_t iv[AES_GCM_IV_SIZE];
+    };
+
+    data_t EncodeV1(int key_index, data_t data);
+    data_t EncodeV2(int key_index, const struct iovec* pieces, size_t count);
+    bool DecodeV1(const uint8_t* packet, size_t count, data_t& data);
+    typedef unordered_multimap<uint32_t, int>::const_iterator KeyIter;
+    // 检查头部的时间、长度和key_id，通过时range为key_id相同的候选密钥；调用者保证count至少是头部加上tag的长度
+    // 只读头部，不分配内存，解密前先检查，收到别的集群或伪造的包时不需要准备输出缓冲
+    bool CheckHeadV2(const uint8_t* packet, size_t count, pair<KeyIter, KeyIter>& range);
+    // 用range中的密钥解密到out，out可以就是包中密文的位置
+    bool DecodeV2(const uint8_t* packet, const pair<KeyIter, KeyIter>& range, uint8_t* out);
+    void Send(const data_t& packet); // 发送到所有端口
+    bool CheckTime(uint32_t time);
+
 private:
-    vector<SecretKey> keys;
+    struct NetKey
+    {
+        AesGcmKey gcm; // gcm.aes也用于版本1
+        uint32_t key_id; // 网络字节序
+    };
+    vector<NetKey> keys;
+    unordered_multimap<uint32_t, int> key_index; // key_id -> keys中的下标
+    int wire_version;
+    bool accept_v1;
     int listen_fd;
+    function<void(const data_t& packet)> sender;
 };
 
 #endif // _NETWORKING_H_
@@ -0,0 +1,71 @@
+#include "options.h"
+#include <cstdlib>
+
+using namespace std;
+
+Options options;
+
+Options::Options()
+{
+    crypto_workers = 0;
+    wire_version = 2;
+    wire_accept_v1 = 1;
+    cache_size = 256;
+    durability = DURABILITY_BATCHED;
+    aes_backend = "auto";
+    readahead = 1024;
+    attr_timeout = 1;
+    fuse_api = "low";
+}
+
+static bool ParseInt(const string& value, int& out)
+{
+    char* end = NULL;
+    long x = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') return false;
+    out = (int)x;
+    return true;
+}
+
+bool ParseOption(const string& arg)
+{
+    size_t pos = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || pos == string::npos) return false;
+    string name = arg.substr(2, pos-2);
+    string value = arg.substr(pos+1);
+
+    if (name == "crypto-workers") {
+        return ParseInt(value, options.crypto_workers) && options.crypto_workers >= 0;
+    }
+    if (name == "aes-backend") {
+        options.aes_backend = value;
+        return value == "auto" || value == "aes-ni" || value == "bitsliced" || value == "table" || value == "bytewise";
+    }
+    if (name == "wire-accept-v1") {
+        return ParseInt(value, options.wire_accept_v1) && (options.wire_accept_v1 == 0 || options.wire_accept_v1 == 1);
+    }
+    if (name == "cache-size") {
+        return ParseInt(value, options.cache_size) && options.cache_size > 0;
+    }
+    if (name == "durability") {
+        if (value == "strict") options.durability = DURABILITY_STRICT;
+        else if (value == "batched") options.durability = DURABILITY_BATCHED;
+        else return false;
+        return true;
+    }
+    if (name == "readahead") {
+        return ParseInt(value, options.readahead) && options.readahead >= 0;
+    }
+    if (name == "fuse-api") {
+        options.fuse_api = value;
+        return value == "low" || value == "high";
+    }
+    if (name == "attr-timeout") {
+        return ParseInt(value, options.attr_timeout) && options.attr_timeout >= 0;
+    }
+    if (name == "wire-version") {
+        return ParseInt(value, options.wire_version) && (options.wire_version == 1 || options.wire_version == 2);
+    }
+
+    return false;
+}
@@ -0,0 +1,31 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include <string>
+
+using namespace std;
+
+#define DURABILITY_STRICT 0 // 每个文件写回后单独fsync
+#define DURABILITY_BATCHED 1 // 后台同步时一批文件写回后只做一次syncfs
+
+// 命令行中以--开头的可选参数
+struct Options
+{
+    int crypto_workers; // 并行加解密的线程数，0表示使用CPU核数，1表示不并行
+    string aes_backend; // AES的实现，见aes_select_backend
+    int wire_version; // 发送数据包的格式，1为旧格式，2为AES-GCM
+    int wire_accept_v1; // 是否接收旧格式的数据包，旧格式需要逐个密钥尝试，所有节点升级后可以关闭
+    int cache_size; // 缓存明文的预算，单位为MiB
+    int durability; // DURABILITY_*
+    int readahead; // 顺序读时最多预读的字节数，单位为KiB，0表示不预读
+    string fuse_api; // "low"使用按inode访问的low-level接口，"high"使用按路径访问的接口
+    int attr_timeout; // 内核缓存文件属性和目录项的时间，单位为秒，0表示不缓存
+
+    Options();
+};
+
+extern Options options;
+
+bool ParseOption(const string& arg); // 解析一个--name=value形式的参数，无法识别则返回false
+
+#endif // _OPTIONS_H_
@@ -0,0 +1,104 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int workers)
+{
+    if (workers <= 0) workers = thread::hardware_concurrency();
+    if (workers <= 0) workers = 1;
+
+    stopping = false;
+    for(int i = 0; i < workers; i ++) {
+        threads.push_back(thread([this]() { WorkerLoop(); }));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(tasks_mutex);
+        stopping = true;
+    }
+    tasks_cv.notify_all();
+    for(auto& t : threads) {
+        t.join();
+    }
+}
+
+int ThreadPool::Workers() const
+{
+    return threads.size();
+}
+
+void ThreadPool::Submit(function<void()> task)
+{
+    {
+        lock_guard<mutex> lock(tasks_mutex);
+        tasks.push_back(move(task));
+    }
+    tasks_cv.notify_one();
+}
+
+void ThreadPool::ParallelFor(size_t count, function<void(size_t)> body)
+{
+    if (count == 0) return;
+    if (count == 1 || threads.empty()) {
+        for(size_t i = 0; i < count; i ++) body(i);
+        return;
+    }
+
+    // 任务可能在ParallelFor返回之后才被线程池取到，所以状态放在shared_ptr里
+    struct State
+    {
+        function<void(size_t)> body;
+        size_t count;
+        atomic<size_t> next;
+        size_t finished;
+        mutex finished_mutex;
+        condition_variable finished_cv;
+    };
+    shared_ptr<State> state = make_shared<State>();
+    state->body = move(body);
+    state->count = count;
+    state->next = 0;
+    state->finished = 0;
+
+    auto run = [state]() {
+        size_t done = 0;
+        for(size_t i = state->next++; i < state->count; i = state->next++) {
+            state->body(i);
+            done ++;
+        }
+        if (done > 0) {
+            lock_guard<mutex> lock(state->finished_mutex);
+            state->finished += done;
+            if (state->finished == state->count) state->finished_cv.notify_all();
+        }
+    };
+
+    size_t helpers = min(count-1, threads.size());
+    for(size_t i = 0; i < helpers; i ++) {
+        Submit(run);
+    }
+    run();
+
+    unique_lock<mutex> lock(state->finished_mutex);
+    state->finished_cv.wait(lock, [&state]() { return state->finished == state->count; });
+}
+
+void ThreadPool::WorkerLoop()
+{
+    while(true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(tasks_mutex);
+            tasks_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return; // stopping
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+// 固定大小的线程池
+class ThreadPool
+{
+public:
+    ThreadPool(int workers); // workers <= 0 时使用CPU核数
+    ~ThreadPool();
+
+    int Workers() const;
+
+    void Submit(function<void()> task); // 异步执行task
+    void ParallelFor(size_t count, function<void(size_t)> body); // 并行执行body(0)...body(count-1)，全部完成后返回，调用线程也参与执行
+
+private:
+    void WorkerLoop();
+
+private:
+    vector<thread> threads;
+    deque<function<void()> > tasks;
+    mutex tasks_mutex;
+    condition_variable tasks_cv;
+    bool stopping;
+};
+
+#endif // _THREAD_POOL_H_